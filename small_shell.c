@@ -1,5 +1,7 @@
 // for struct sigaction for signal handling
 #define _POSIX_C_SOURCE 200809L
+// for syscall() - used to open pidfds for the foreground wait loop
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,27 +12,183 @@
 #include <sys/types.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <dlfcn.h>
+#include <stdio_ext.h>
+#include "smallsh_builtin.h"
+
+// one redirect from the command line. a file redirect opens file with
+// flags onto fd, a duplication (from_fd >= 0) makes fd a copy of from_fd
+struct Redirect {
+  int fd;
+  int flags;
+  int from_fd;
+  char file[256];
+};
 
 struct Command {
   bool exit;
   bool change_directory;
   bool status;
   bool other_command;
-  bool input_redirect;
-  bool output_redirect;
-  // as per the requirements
-  char arguments[2048];
-  char input_file[256];
-  char output_file[256];
+  // sized for the input line it came from, see initialize_command_struct
+  char* arguments;
+  size_t arguments_size;
+  // applied in the order they were written, see apply_redirects
+  struct Redirect redirects[16];
+  int redirect_count;
   bool background;
   bool process_id_called;
   bool background_processes_allowed;
   bool echo_command;
+  // set by the timeout builtin: 'timeout [-k GRACE] DURATION cmd ...'
+  // a value of 0 means the job has no deadline
+  long long timeout_ms;
+  long long timeout_grace_ms;
+  bool syntax_error;
+  bool trace_command;
+  bool stats_command;
+  // set by the memo prefix: 'memo cmd ...'
+  bool memo;
+  bool enable_command;
+  bool joblog_command;
+  // set by the coproc prefix: 'coproc NAME cmd ...', an empty name
+  // lists the running coprocesses
+  bool coproc_command;
+  char coproc_name[64];
+  // index into loaded_builtins, -1 when the command isn't one
+  int loaded_builtin;
+};
+
+// everything find_core_builtin can recognize - the builtins, plus the
+// background operator. redirects come in too many forms for a table,
+// parse_redirect sorts those out
+enum BuiltinId {
+  NOT_A_BUILTIN,
+  BUILTIN_ECHO,
+  BUILTIN_EXIT,
+  BUILTIN_CD,
+  BUILTIN_STATUS,
+  BUILTIN_STATS,
+  BUILTIN_TRACE,
+  BUILTIN_TIMEOUT,
+  BUILTIN_MEMO,
+  BUILTIN_ENABLE,
+  BUILTIN_JOBLOG,
+  BUILTIN_COPROC,
+  BUILTIN_BACKGROUND
+};
+
+struct CoreBuiltin {
+  char* name;
+  enum BuiltinId id;
+};
+
+// the fds an in-process builtin's redirects replaced, so the shell can
+// put its own back afterwards. saved is -1 where the fd wasn't open
+struct SavedFds {
+  int count;
+  int fds[16];
+  int saved[16];
+  int fd_flags[16];
+};
+
+// a builtin loaded from a shared library with 'enable -f'
+struct LoadedBuiltin {
+  char name[64];
+  char library_path[256];
+  void* library;
+  struct smallsh_builtin *builtin;
+};
+
+struct LoadedBuiltins {
+  int size;
+  struct LoadedBuiltin builtins[32];
+};
+
+// stdout/stderr of a background job, captured through a pipe into a
+// fixed size ring. once the ring is full the oldest bytes either go
+// to a spill file or are dropped
+struct JobOutput {
+  bool in_use;
+  int job_number;
+  pid_t pid;
+  // lets the oldest finished capture make way when all slots are taken
+  unsigned long long sequence;
+  // -1 once every process in the job has closed its end
+  int pipe_fd;
+  char* ring;
+  size_t capacity;
+  size_t start;
+  size_t length;
+  unsigned long long total_bytes;
+  unsigned long long overflow_bytes;
+  int spill_fd;
+  char spill_path[256];
+};
+
+struct JobOutputs {
+  // applies to jobs started from now on
+  size_t capacity_setting;
+  // empty when spilling is off
+  char spill_dir[200];
+  int open_pipes;
+  unsigned long long sequence;
+  struct JobOutput jobs[100];
+};
+
+// a long-lived job started with 'coproc NAME cmd'. the shell keeps the
+// other ends of its stdin and stdout, which redirects reach as ${NAME[0]}
+// (what it writes) and ${NAME[1]} (its stdin)
+struct Coprocess {
+  char name[64];
+  pid_t pid;
+  int read_fd;
+  int write_fd;
+};
+
+struct Coprocesses {
+  int size;
+  struct Coprocess coprocs[16];
 };
 
 struct BackgroundPIDs {
   int size;
-  pid_t pids[100];
+  // grows as needed, see add_background_pid
+  int capacity;
+  pid_t* pids;
+  // kept in step with pids, for the trace
+  pid_t* pgids;
+  long long* started_at_ns;
+  // read end of the job's exec status pipe, see collect_exec_status
+  int* exec_status_fds;
+};
+
+// buffered read() based reader for the command line - no limit on line length
+struct LineReader {
+  int fd;
+  char* buffer;
+  size_t capacity;
+  // unread input is buffer[start, end), of which
+  // buffer[start, scanned) is known to have no newline
+  size_t start;
+  size_t scanned;
+  size_t end;
+  bool eof;
 };
 
 struct Status {
@@ -39,34 +197,138 @@ struct Status {
   bool fg_process_exit;
   bool fg_process_terminated;
   int fg_process_exit_or_term_reason;
+  bool fg_process_timed_out;
+  bool fg_process_killed_after_grace;
+};
+
+// a job deadline - once expires_at_ns passes, the job's process group
+// gets SIGTERM, and if it's still around grace_ns later, SIGKILL
+struct Deadline {
+  bool in_use;
+  pid_t pid;
+  long long expires_at_ns;
+  long long grace_ns;
+  bool timed_out;
+  bool killed_after_grace;
+  // position of this deadline in the timer heap, -1 once it has fired
+  // its last stage (SIGKILL) and only the outcome is left to collect
+  int heap_index;
+};
+
+// min-heap of deadlines ordered by expires_at_ns, driven by a single timerfd
+// which is always armed for the earliest deadline in the heap
+struct DeadlineHeap {
+  int timer_fd;
+  int size;
+  int heap[128];
+  struct Deadline deadlines[128];
+};
+
+enum TraceEventType {
+  TRACE_SPAWN,
+  TRACE_EXIT,
+  TRACE_REDIRECT,
+  TRACE_SIGNAL
+};
+
+struct TraceEvent {
+  enum TraceEventType type;
+  long long timestamp_ns;
+  pid_t pid;
+  pid_t pgid;
+  // exit code or signal number for exits, fd for redirects,
+  // signal number for signals
+  int code;
+  bool signaled;
+  long long duration_ns;
+  // argv (space separated), redirect path or signal reason
+  char detail[2048];
+};
+
+// opt-in spawn trace - the shell fills a fixed ring of events and a
+// flusher thread turns them into JSONL, so tracing never blocks a spawn
+struct TraceRing {
+  // only touched by the shell thread, the one branch paid when tracing is off
+  bool enabled;
+  int fd;
+  pthread_t flusher;
+  sem_t wakeup;
+  atomic_bool stop;
+  atomic_uint head;
+  atomic_uint tail;
+  atomic_ulong dropped;
+  struct TraceEvent events[256];
+};
+
+// counters behind the stats builtin. atomics because the prometheus
+// exporter thread reads them while the shell keeps updating them
+struct ShellMetrics {
+  long long started_at_ns;
+  atomic_ullong spawns;
+  atomic_ullong exec_failures;
+  atomic_int background_jobs;
+  atomic_ullong jobs_killed_by_signal;
+  atomic_ullong fg_wait_count;
+  atomic_ullong fg_wait_sum_ns;
+  // one per entry in fg_wait_bucket_bounds_ns, the +Inf bucket is fg_wait_count
+  atomic_ullong fg_wait_buckets[7];
+  atomic_ullong parse_count;
+  atomic_ullong parse_sum_ns;
+  // prometheus textfile export
+  bool exporting;
+  char export_path[256];
+  long long export_interval_ms;
+  pthread_t exporter;
+  sem_t export_wakeup;
+  atomic_bool stop_export;
+};
+
+// a memo cache file, as seen by eviction
+struct MemoEntry {
+  char name[256];
+  long long size;
+  long long mtime_ns;
 };
 
 void print_to_console(char string_text[]);
-char* get_input_from_user();
+void initialize_line_reader(struct LineReader *reader, int fd);
+char* read_line(struct LineReader *reader, size_t *line_length);
+void announce_foreground_only_mode(bool reprompt);
 void lower_case_string(char string_text[]);
 void assign_user_values_to_command_struct(char text_string[], struct Command *command_ptr);
 bool is_blank(char text_string[]);
-bool set_exit_flag(char* token_ptr, struct Command *command_ptr);
-bool set_change_directory_flag(char* token_ptr, struct Command *command_ptr);
-bool set_status_flag(char* token_ptr, struct Command *command_ptr);
-bool set_output_file(char* token_ptr, struct Command *command_ptr);
-bool set_input_file(char* token_ptr, struct Command *command_ptr);
-bool set_background_flag(char* token_ptr, struct Command *command_ptr);
+void set_exit_flag(struct Command *command_ptr);
+void set_change_directory_flag(struct Command *command_ptr);
+void set_status_flag(struct Command *command_ptr);
+bool could_be_redirect(char* token_ptr);
+bool parse_redirect(char* token_ptr, struct Command *command_ptr);
+void add_redirect(struct Command *command_ptr, int fd, int flags, int from_fd, char* file_name_ptr);
+void set_remaining_arguments(struct Command *command_ptr);
+void set_trailing_redirects(struct Command *command_ptr);
+void set_background_flag(struct Command *command_ptr);
 bool set_process_id_called_flag(char* token_ptr, struct Command *command_ptr);
-void remove_newline_from_string(char string_text[]);
 void log_command_struct(struct Command *command_ptr);
-void initialize_command_struct(struct Command *command_ptr);
+void initialize_command_struct(struct Command *command_ptr, size_t line_length);
+void free_command_struct(struct Command *command_ptr);
+void terminate_background_processes(struct BackgroundPIDs *background_pids);
+void signal_background_job(struct BackgroundPIDs *background_pids, int index, int signo, char* reason);
 void set_other_command_and_arguments(char* token_ptr, struct Command *command_ptr);
 bool check_if_token_is_actually_a_test_comment(char* token_ptr, struct Command *command_ptr);
 void change_directory(struct Command *command_ptr);
 void execute_command(struct Command *command_ptr, struct BackgroundPIDs *background_pids, struct Status *status_ptr);
-void set_output_redirect_fg(char* file_name_ptr);
-void set_input_redirect_fg(char* file_name_ptr);
-void set_output_redirect_bg();
-void set_input_redirect_bg();
-void set_any_redirects(struct Command *command_ptr);
-void create_arguments_array(char arguments[2048], char* arg_array[512]);
+void set_any_redirects(struct Command *command_ptr, int capture_fd);
+int move_fd_high(int fd);
+int internal_pipe(int pipe_fds[2]);
+bool apply_redirects(struct Command *command_ptr, struct SavedFds *saved_fds);
+bool save_redirected_fd(struct SavedFds *saved_fds, int fd);
+void restore_redirects(struct SavedFds *saved_fds);
+void trace_redirects(pid_t pid, struct Command *command_ptr);
+char** create_arguments_array(char arguments[]);
 void initialize_background_pids_struct(struct BackgroundPIDs *background_pids);
+void add_background_pid(struct BackgroundPIDs *background_pids, pid_t pid, pid_t pgid, long long started_at_ns, int exec_status_fd);
+void free_background_pids_struct(struct BackgroundPIDs *background_pids);
+void raise_fd_limit();
+void collect_exec_status(int exec_status_fd);
 void reap_terminated_child_processes(struct BackgroundPIDs *background_pids);
 void print_foreground_process_status(struct Status *status);
 void set_ignore_sigint();
@@ -76,14 +338,131 @@ void SIGTSTP_handler(int signo);
 void set_ignore_sigtstp();
 void child_process_ignore_sigtstp();
 int perform_variable_expansion(char argument_str[], char* new_str);
-bool set_echo_command(char* token_ptr, struct Command *command_ptr);
+void set_echo_command(struct Command *command_ptr);
+bool set_timeout_flag(struct Command *command_ptr);
+bool parse_duration_ms(char* duration_str, long long *duration_ms);
+long long monotonic_time_ns();
+pid_t wait_for_foreground_process(pid_t spawn_pid, int *child_status);
+void give_terminal_to_process_group(pid_t pgid);
+bool add_deadline(pid_t pid, long long timeout_ms, long long grace_ms);
+void take_deadline_outcome(pid_t pid, bool *timed_out, bool *killed_after_grace);
+void service_expired_deadlines();
+void arm_deadline_timer();
+void deadline_heap_swap(int a, int b);
+void deadline_heap_sift_up(int index);
+void deadline_heap_sift_down(int index);
+void deadline_heap_remove(int index);
+bool set_trace_flag(struct Command *command_ptr);
+void set_trace_output(char* file_name_ptr);
+void start_spawn_trace(int trace_fd);
+void stop_spawn_trace();
+struct TraceEvent* reserve_trace_event();
+void commit_trace_event();
+void trace_spawn(pid_t pid, pid_t pgid, char arguments[]);
+void trace_exit(pid_t pid, pid_t pgid, int child_status, long long duration_ns);
+void trace_redirect(pid_t pid, int fd, char* file_name_ptr);
+void trace_signal(pid_t target, int signo, char* reason);
+void* spawn_trace_flusher(void* unused);
+size_t format_trace_event(struct TraceEvent *event, char* output, size_t output_size);
+size_t format_json_string(char* string_text, size_t string_length, char* output);
+void write_all(int fd, char* buffer, size_t length);
+bool set_stats_flag(struct Command *command_ptr);
+void observe_foreground_wait(long long wait_ns);
+void observe_parse_time(long long parse_ns);
+void print_shell_stats(char arguments[]);
+void set_metrics_export(char* path_ptr, char* interval_ptr);
+void stop_metrics_export();
+void* metrics_exporter(void* unused);
+void write_prometheus_metrics();
+size_t format_prometheus_metrics(char* output, size_t output_size);
+bool set_memo_flag(struct Command *command_ptr);
+void execute_memoized_command(struct Command *command_ptr, struct BackgroundPIDs *background_pids, struct Status *status_ptr);
+bool get_memo_directory(char* memo_dir, size_t memo_dir_size);
+bool make_directories(char* path);
+bool build_memo_key(struct Command *command_ptr, char** key, size_t* key_length);
+uint64_t fnv1a_hash(char* data, size_t length);
+bool replay_memo_entry(char* entry_path, char* key, size_t key_length, struct Command *command_ptr, int *exit_code);
+bool copy_memo_output(int from_fd, off_t length, int to_fd);
+int open_memo_stdout(struct Command *command_ptr, bool *opened);
+int compare_memo_entries_by_age(const void* a, const void* b);
+void evict_memo_entries(char* memo_dir);
+enum BuiltinId find_core_builtin(char* token_ptr);
+bool set_enable_flag(struct Command *command_ptr);
+int find_loaded_builtin(char* token_ptr);
+void enable_builtin(char arguments[]);
+void load_builtin(char* library_ptr, char* name_ptr);
+void unload_builtin(int index);
+int run_loaded_builtin(struct Command *command_ptr);
+void execute_loaded_builtin(struct Command *command_ptr, struct Status *status_ptr);
+bool set_joblog_flag(struct Command *command_ptr);
+struct JobOutput* start_job_output(int job_number, pid_t pid, int pipe_fd);
+void discard_job_output(struct JobOutput *job_output);
+void drain_job_output(struct JobOutput *job_output);
+void append_job_output(struct JobOutput *job_output, char* data, size_t length);
+void overflow_job_output(struct JobOutput *job_output, size_t length);
+void spill_job_output(struct JobOutput *job_output, char* data, size_t length);
+struct JobOutput* find_job_output(char* job_ptr);
+void joblog_builtin(char arguments[]);
+int add_event_poll_fds(struct pollfd poll_fds[], int poll_fd_count);
+void handle_event_poll_fds(struct pollfd poll_fds[], int first, int poll_fd_count);
+bool set_coproc_flag(struct Command *command_ptr);
+void start_coprocess(struct Command *command_ptr, struct BackgroundPIDs *background_pids, struct Status *status_ptr);
+struct Coprocess* find_coprocess(char* name_ptr);
+void forget_coprocess(pid_t pid);
+bool parse_coprocess_fd(char* reference_ptr, long *fd);
 
 bool turn_off_background = false;
 bool SIGTSTP_called = false;
 pid_t smallsh_pid;
+struct DeadlineHeap deadline_heap = { .timer_fd = -1, .size = 0 };
+struct TraceRing spawn_trace = { .enabled = false, .fd = -1 };
+struct ShellMetrics shell_metrics = { .exporting = false };
+// the fd limit the shell started with - it raises its own to fit one
+// exec status pipe per background job, children get the original back
+struct rlimit original_fd_limit;
+bool fd_limit_raised = false;
+// upper bounds of the foreground wait histogram buckets: 1ms up to 1min
+long long fg_wait_bucket_bounds_ns[7] = {
+  1000000LL, 10000000LL, 100000000LL, 1000000000LL,
+  10000000000LL, 30000000000LL, 60000000000LL
+};
+// fixed width, so the trailer of a memo entry is always the same length
+char memo_trailer_format[] = "smallsh-memo %4d %20lld %20lld\n";
+// slot of a core builtin: (first char + 2 * last char + 8 * length) % 32.
+// the multipliers were picked (by trying them in order) so no two names
+// share a slot. it's a constant expression, so core_builtins is laid out
+// by the compiler
+#define CORE_SLOT(first, last, length) (((first) + 2 * (last) + 8 * (length)) % 32)
+#define CORE_BUILTIN(first, last, name, id) [CORE_SLOT(first, last, sizeof(name) - 1)] = { name, id }
+// perfect hash table of the core builtins, see find_core_builtin.
+// two names in one slot would quietly override each other, so that's
+// made a build error - pick new multipliers if it ever fires
+#pragma GCC diagnostic push
+#pragma GCC diagnostic error "-Woverride-init"
+struct CoreBuiltin core_builtins[32] = {
+  CORE_BUILTIN('e', 'o', "echo", BUILTIN_ECHO),
+  CORE_BUILTIN('e', 't', "exit", BUILTIN_EXIT),
+  CORE_BUILTIN('c', 'd', "cd", BUILTIN_CD),
+  CORE_BUILTIN('s', 's', "status", BUILTIN_STATUS),
+  CORE_BUILTIN('s', 's', "stats", BUILTIN_STATS),
+  CORE_BUILTIN('t', 'e', "trace", BUILTIN_TRACE),
+  CORE_BUILTIN('t', 't', "timeout", BUILTIN_TIMEOUT),
+  CORE_BUILTIN('m', 'o', "memo", BUILTIN_MEMO),
+  CORE_BUILTIN('e', 'e', "enable", BUILTIN_ENABLE),
+  CORE_BUILTIN('j', 'g', "joblog", BUILTIN_JOBLOG),
+  CORE_BUILTIN('c', 'c', "coproc", BUILTIN_COPROC),
+  CORE_BUILTIN('&', '&', "&", BUILTIN_BACKGROUND),
+};
+#pragma GCC diagnostic pop
+struct LoadedBuiltins loaded_builtins = { .size = 0 };
+struct Coprocesses coprocesses = { .size = 0 };
+// 64KB of output kept per background job unless 'joblog -c' says otherwise
+struct JobOutputs job_outputs = { .capacity_setting = 64 * 1024, .spill_dir = "", .open_pipes = 0 };
 
 int main() {
   smallsh_pid = getpid();
+  raise_fd_limit();
+  shell_metrics.started_at_ns = monotonic_time_ns();
   
   // set IGNORE signal handler for SIG_INT
   set_ignore_sigint();
@@ -91,6 +470,18 @@ int main() {
   // set custom behavior for SIGTSTP
   set_sigtstp_handler();
 
+  // SMALLSH_TRACE=file turns the spawn trace on from the start
+  char* trace_file_ptr = getenv("SMALLSH_TRACE");
+  if (trace_file_ptr) {
+    set_trace_output(trace_file_ptr);
+  }
+
+  // SMALLSH_METRICS_FILE=file [SMALLSH_METRICS_INTERVAL=15s] exports metrics
+  char* metrics_file_ptr = getenv("SMALLSH_METRICS_FILE");
+  if (metrics_file_ptr) {
+    set_metrics_export(metrics_file_ptr, getenv("SMALLSH_METRICS_INTERVAL"));
+  }
+
   // used to keep track of background processes
   struct BackgroundPIDs background_pids;
   initialize_background_pids_struct(&background_pids);
@@ -98,10 +489,36 @@ int main() {
   // keeps track of foreground exit statuses
   struct Status status;
   status.fg_process_status = false;
+
+  struct LineReader input_reader;
+  initialize_line_reader(&input_reader, STDIN_FILENO);
   
   bool keep_console_on = true;
   while(keep_console_on) {
 
+    // fire any job deadlines that passed while we were busy
+    if (deadline_heap.size) {
+      service_expired_deadlines();
+    }
+
+    // manage bg processes
+    if (background_pids.size) {
+      reap_terminated_child_processes(&background_pids);
+    }
+
+    // get input from user - SIGTSTP interrupting the read is
+    // handled inside read_line, which just picks up where it left off
+    announce_foreground_only_mode(false);
+    print_to_console(": ");
+    size_t input_length;
+    char* input_text_ptr = read_line(&input_reader, &input_length);
+
+    // running out of input is the same as 'exit'
+    if (input_text_ptr == NULL) {
+      terminate_background_processes(&background_pids);
+      break;
+    }
+
     // Command struct abstracts user entry string from
     // all of the various built-in commands
     // provides a safer way to start and stop commands
@@ -110,47 +527,9 @@ int main() {
     // using dynamic allocation here because otherwise
     // the command_ptr doesn't reset with each loop
     command_ptr = malloc(sizeof(struct Command));
-    initialize_command_struct(command_ptr);
-    
-    // manage bg processes
-    if (background_pids.size) {
-      reap_terminated_child_processes(&background_pids);
-    }
-    
-    // get input from user and verify it has no errors
-    // SIGTSTP was causing errors in stdin - this should avoid that!
-    bool input_error = false;
-    char* input_text_ptr;
-    do {
-      // for SIGTSTP signals
-      if (SIGTSTP_called) {
-        if (turn_off_background) {
-          printf("\nEntering foreground-only mode (& is now ignored)\n");
-          fflush(stdout);
-          command_ptr->background_processes_allowed = false;
-        } else if (!turn_off_background) {
-          printf("\nExiting foreground-only mode\n");
-          fflush(stdout);
-          command_ptr->background_processes_allowed = true;
-        }
-        SIGTSTP_called = false;
-      }
-
-      print_to_console(": ");
-      input_text_ptr = get_input_from_user();
-      
-      // checking if stdin has errors
-      // weird characters cause the program to misfire invalid commands!
-      if (ferror(stdin)) {
-        clearerr(stdin);
-        free(input_text_ptr);
-        input_error = true;
-      } else {
-        input_error = false;
-      }
-    } while (input_error);
+    initialize_command_struct(command_ptr, input_length);
 
-    remove_newline_from_string(input_text_ptr);
+    long long parse_started_at_ns = monotonic_time_ns();
     assign_user_values_to_command_struct(input_text_ptr, command_ptr);
 
     // checking if '$$' was used in command, if so, change string to PID #
@@ -159,8 +538,7 @@ int main() {
       // then once the process is complete, erase whatever is
       // in command_ptr->arguments and string copy the altered string
       // into command_ptr->arguments.
-      char new_test_str[strlen(command_ptr->arguments) + 7];
-      memset(new_test_str, '\0', sizeof(new_test_str));
+      char* new_test_str = calloc(command_ptr->arguments_size, sizeof(char));
 
       // keep calling the perform_variable_expansion function
       // if the function returns 0, which means there are
@@ -169,9 +547,9 @@ int main() {
       while (result == 0) {
         result = perform_variable_expansion(command_ptr->arguments, new_test_str);
         if (result == 0) {
-          memset(command_ptr->arguments, '\0', sizeof(command_ptr->arguments));
+          memset(command_ptr->arguments, '\0', command_ptr->arguments_size);
           strcpy(command_ptr->arguments, new_test_str);
-          memset(new_test_str, '\0', sizeof(new_test_str));
+          memset(new_test_str, '\0', command_ptr->arguments_size);
 
         } else {
           // anything other than 0 is returned, means there are no
@@ -180,22 +558,69 @@ int main() {
         }
       }
       // store the newly altered string into command_ptr->arguments
-      memset(command_ptr->arguments, '\0', sizeof(command_ptr->arguments));
+      memset(command_ptr->arguments, '\0', command_ptr->arguments_size);
       strcpy(command_ptr->arguments, new_test_str);
+      free(new_test_str);
+    }
+    observe_parse_time(monotonic_time_ns() - parse_started_at_ns);
+
+    // loaded builtins run in-process unless they need a process of their
+    // own - in the background, or to be killed on a deadline
+    bool run_loaded_builtin_in_process = command_ptr->loaded_builtin >= 0 &&
+      !command_ptr->background && !command_ptr->timeout_ms && !command_ptr->memo;
+    // builtins that run inside the shell get their redirects applied to
+    // the shell's own fds, put back once they're done
+    struct SavedFds saved_fds = { .count = 0 };
+    bool runs_in_process = command_ptr->change_directory || command_ptr->trace_command ||
+      command_ptr->stats_command || command_ptr->joblog_command || command_ptr->enable_command ||
+      command_ptr->status || run_loaded_builtin_in_process;
+    if (runs_in_process && !command_ptr->syntax_error && !apply_redirects(command_ptr, &saved_fds)) {
+      command_ptr->syntax_error = true;
     }
 
     // handle comment lines
     if (command_ptr->arguments[0] == '#') {
-      continue;
+      // nothing to do
 
     // handle blank lines
     } else if (is_blank(input_text_ptr)) {
-      continue;
+      // nothing to do
+
+    // a builtin couldn't make sense of its arguments (or open its
+    // redirects), it already said why
+    } else if (command_ptr->syntax_error) {
+      status.fg_process_status = true;
+      status.fg_process_pid = 0;
+      status.fg_process_exit = true;
+      status.fg_process_terminated = false;
+      status.fg_process_exit_or_term_reason = 1;
+      status.fg_process_timed_out = false;
+      status.fg_process_killed_after_grace = false;
 
     // handle change directory call
     } else if (command_ptr->change_directory) {
       change_directory(command_ptr);
 
+    // handle trace call
+    } else if (command_ptr->trace_command) {
+      set_trace_output(command_ptr->arguments);
+
+    // handle stats call
+    } else if (command_ptr->stats_command) {
+      print_shell_stats(command_ptr->arguments);
+
+    // handle joblog call
+    } else if (command_ptr->joblog_command) {
+      joblog_builtin(command_ptr->arguments);
+
+    // handle enable call
+    } else if (command_ptr->enable_command) {
+      enable_builtin(command_ptr->arguments);
+
+    // handle loaded builtins that can run in-process
+    } else if (run_loaded_builtin_in_process) {
+      execute_loaded_builtin(command_ptr, &status);
+
     // handle status call
     } else if (command_ptr->status) {
       // prints out either the exit status or
@@ -212,27 +637,59 @@ int main() {
     // exit while loop if user says so
     } else if (command_ptr->exit) {
       // release resources
-      free(input_text_ptr);
-      free(command_ptr);
+      free_command_struct(command_ptr);
       // terminate all child background processes
-      if (background_pids.size) {
-        int sig = 15;
-        for (int i = 0; i < background_pids.size; i++) {
-          kill(background_pids.pids[i], sig);
-        }
-      }
+      terminate_background_processes(&background_pids);
       break;
 
+    // handle coproc call
+    } else if (command_ptr->coproc_command) {
+      start_coprocess(command_ptr, &background_pids, &status);
+
+    // a prefix with no command after it - there's nothing to exec
+    } else if ((command_ptr->timeout_ms > 0 || command_ptr->memo) && !command_ptr->other_command) {
+      fprintf(stderr, "%s: missing command\n", command_ptr->memo ? "memo" : "timeout");
+      fflush(stderr);
+      status.fg_process_status = true;
+      status.fg_process_pid = 0;
+      status.fg_process_exit = true;
+      status.fg_process_terminated = false;
+      status.fg_process_exit_or_term_reason = 1;
+      status.fg_process_timed_out = false;
+      status.fg_process_killed_after_grace = false;
+
+    // run it through the memo cache
+    } else if (command_ptr->memo && !command_ptr->background) {
+      execute_memoized_command(command_ptr, &background_pids, &status);
+
     } else {
       // anything that doesn't match the above conditions,
       // means its probably a command to execute!
+      if (command_ptr->memo) {
+        fprintf(stderr, "memo: background jobs aren't memoized\n");
+        fflush(stderr);
+      }
       execute_command(command_ptr, &background_pids, &status);
     }
+    restore_redirects(&saved_fds);
     // release resources
-    free(input_text_ptr);
-    free(command_ptr);
+    free_command_struct(command_ptr);
+  }
+  free(input_reader.buffer);
+  free_background_pids_struct(&background_pids);
+  for (int i = 0; i < sizeof(job_outputs.jobs) / sizeof(job_outputs.jobs[0]); i++) {
+    if (job_outputs.jobs[i].in_use) {
+      discard_job_output(&job_outputs.jobs[i]);
+    }
   }
 
+  // flush out whatever the trace still holds
+  if (spawn_trace.enabled) {
+    stop_spawn_trace();
+  }
+  if (shell_metrics.exporting) {
+    stop_metrics_export();
+  }
   return 0;
 }
 
@@ -242,6 +699,28 @@ void execute_command(
   struct Status *status_ptr
 ) {
   int child_status;
+  bool run_in_background = command_ptr->background && command_ptr->background_processes_allowed;
+  // jobs with a deadline run in their own process group so the
+  // whole job (not just its first process) can be signalled on expiry,
+  // so do background jobs for the same reason on exit
+  bool own_process_group = command_ptr->timeout_ms > 0 || run_in_background;
+  bool owns_terminal = own_process_group && !run_in_background && isatty(STDIN_FILENO);
+  long long started_at_ns = monotonic_time_ns();
+
+  // the child reports a failed execvp through this pipe, on success
+  // exec closes it (O_CLOEXEC) and the parent reads nothing. it's only
+  // read once the child has been reaped, see collect_exec_status
+  int exec_status_pipe[2] = { -1, -1 };
+  if (internal_pipe(exec_status_pipe) == -1) {
+    perror("exec status pipe2()");
+  }
+
+  // background output that isn't redirected is captured for joblog,
+  // stdout and stderr share one pipe so they stay in order
+  int capture_pipe[2] = { -1, -1 };
+  if (run_in_background && internal_pipe(capture_pipe) == -1) {
+    perror("background output pipe2()");
+  }
   pid_t spawn_pid = fork();
 
   switch(spawn_pid) {
@@ -252,53 +731,130 @@ void execute_command(
     }
     case 0: {
       // In the child process now     
+      if (own_process_group) {
+        setpgid(0, 0);
+        // foreground jobs in their own group still need the terminal,
+        // otherwise ctrl-c wouldn't reach them
+        if (owns_terminal) {
+          give_terminal_to_process_group(getpid());
+        }
+      }
+
       // setting any redirects for fg and bg commands
-      set_any_redirects(command_ptr);
+      set_any_redirects(command_ptr, capture_pipe[1]);
 
       // default SIGINT behavior only for foreground processes
       if (!command_ptr->background) {
         set_default_sigint();
       }
 
+      // a loaded builtin that needed a process of its own. it never
+      // execs, so O_CLOEXEC won't close the exec status pipe for it
+      if (command_ptr->loaded_builtin >= 0) {
+        if (exec_status_pipe[1] != -1) {
+          close(exec_status_pipe[1]);
+        }
+        exit(run_loaded_builtin(command_ptr));
+      }
+
       // creating the command for execution with exec
-      // as per the requirements, we can take up to 512 arguments
-      char* arg_array[512];
-      create_arguments_array(command_ptr->arguments, arg_array);
+      char** arg_array = create_arguments_array(command_ptr->arguments);
+
+      // the program gets the fd limit the shell started with. only now,
+      // the shell's fds above it are still open until exec closes them
+      if (fd_limit_raised) {
+        setrlimit(RLIMIT_NOFILE, &original_fd_limit);
+      }
 
       // execute it!
       int status_code = execvp(arg_array[0], arg_array);
       // this piece only runs if a failure happens in exec
       if (status_code < 0) {
+        int exec_errno = errno;
+        if (exec_status_pipe[1] != -1) {
+          write(exec_status_pipe[1], &exec_errno, sizeof(exec_errno));
+        }
+        errno = exec_errno;
         perror("execvp");
         exit(EXIT_FAILURE);
       }
       break;
     }
     default: {     
+      if (own_process_group) {
+        // done in both parent and child, whoever gets there first wins
+        setpgid(spawn_pid, spawn_pid);
+        if (owns_terminal) {
+          give_terminal_to_process_group(spawn_pid);
+        }
+        if (command_ptr->timeout_ms > 0 &&
+            !add_deadline(spawn_pid, command_ptr->timeout_ms, command_ptr->timeout_grace_ms)) {
+          fprintf(stderr, "timeout: too many deadlines, %d will run without one\n", spawn_pid);
+          fflush(stderr);
+        }
+      }
+      pid_t spawn_pgid = own_process_group ? spawn_pid : getpgrp();
+      atomic_fetch_add_explicit(&shell_metrics.spawns, 1, memory_order_relaxed);
+
+      // never wait on the child here - it may stall before exec (opening
+      // a fifo, say) and the shell has to keep going, deadlines included
+      if (exec_status_pipe[0] != -1) {
+        close(exec_status_pipe[1]);
+        fcntl(exec_status_pipe[0], F_SETFL, O_NONBLOCK);
+      }
+
+      if (spawn_trace.enabled) {
+        trace_spawn(spawn_pid, spawn_pgid, command_ptr->arguments);
+        trace_redirects(spawn_pid, command_ptr);
+      }
+
       // check if process is a background process 
-      if (command_ptr->background && command_ptr->background_processes_allowed) {
+      if (run_in_background) {
         fflush(stdout);
         // add the child's pid to the background_pids array
-        background_pids->pids[background_pids->size] = spawn_pid;
+        add_background_pid(background_pids, spawn_pid, spawn_pgid, started_at_ns, exec_status_pipe[0]);
         // print out something helpful similar to bash
-        printf(
-          "[%d] %d\n",
-          (background_pids->size + 1),
-          background_pids->pids[background_pids->size]
-        );
+        printf("[%d] %d\n", background_pids->size, spawn_pid);
         fflush(stdout);
-        // keep track of the size of the background_pids_array
-        background_pids->size += 1;
+        if (capture_pipe[0] != -1) {
+          close(capture_pipe[1]);
+          if (!start_job_output(background_pids->size, spawn_pid, capture_pipe[0])) {
+            // no room to keep it, throw the output away rather than block the job
+            fprintf(stderr, "joblog: too many captured jobs, output of %d is discarded\n", spawn_pid);
+            fflush(stderr);
+            close(capture_pipe[0]);
+          }
+        }
+        atomic_store(&shell_metrics.background_jobs, background_pids->size);
       
       // if not a background process, handle normally
       } else {
-        spawn_pid = waitpid(spawn_pid, &child_status, 0);
-        if (spawn_pid == -1) {
-          if (WIFSIGNALED(child_status)) {
-            printf("waitpid() interrupted: term signal %d\n", WTERMSIG(child_status));
-            fflush(stdout);
-          }
-        } 
+        pid_t waited_pid = wait_for_foreground_process(spawn_pid, &child_status);
+        collect_exec_status(exec_status_pipe[0]);
+        if (owns_terminal) {
+          give_terminal_to_process_group(getpgrp());
+        }
+        if (waited_pid == -1) {
+          perror("waitpid()");
+          return;
+        }
+        long long finished_at_ns = monotonic_time_ns();
+        observe_foreground_wait(finished_at_ns - started_at_ns);
+        if (!WIFEXITED(child_status)) {
+          atomic_fetch_add_explicit(&shell_metrics.jobs_killed_by_signal, 1, memory_order_relaxed);
+        }
+        if (spawn_trace.enabled) {
+          trace_exit(spawn_pid, spawn_pgid, child_status, finished_at_ns - started_at_ns);
+        }
+        status_ptr->fg_process_timed_out = false;
+        status_ptr->fg_process_killed_after_grace = false;
+        if (own_process_group) {
+          take_deadline_outcome(
+            spawn_pid,
+            &status_ptr->fg_process_timed_out,
+            &status_ptr->fg_process_killed_after_grace
+          );
+        }
         if (WIFEXITED(child_status)) {
           status_ptr->fg_process_status = true;
           status_ptr->fg_process_pid = spawn_pid;
@@ -322,6 +878,70 @@ void execute_command(
   }
 }
 
+pid_t wait_for_foreground_process(pid_t spawn_pid, int *child_status) {
+  // nothing else to look after, a plain blocking waitpid does the job
+  if (deadline_heap.size == 0 && job_outputs.open_pipes == 0) {
+    pid_t result;
+    do {
+      result = waitpid(spawn_pid, child_status, 0);
+    } while (result == -1 && errno == EINTR);
+    return result;
+  }
+
+  // otherwise wait on the child, the deadline timer and background
+  // output together. a pidfd turns readable when the child exits, if the kernel is too
+  // old for pidfds fall back to checking on the child every 50ms
+  int pid_fd = -1;
+#ifdef SYS_pidfd_open
+  pid_fd = syscall(SYS_pidfd_open, spawn_pid, 0);
+#endif
+
+  pid_t result;
+  while (true) {
+    result = waitpid(spawn_pid, child_status, WNOHANG);
+    if (result != 0 && !(result == -1 && errno == EINTR)) {
+      break;
+    }
+
+    struct pollfd poll_fds[128];
+    int poll_fd_count = 0;
+    if (pid_fd >= 0) {
+      poll_fds[poll_fd_count].fd = pid_fd;
+      poll_fds[poll_fd_count].events = POLLIN;
+      poll_fd_count += 1;
+    }
+    int first_event_fd = poll_fd_count;
+    poll_fd_count = add_event_poll_fds(poll_fds, poll_fd_count);
+
+    int ready = poll(poll_fds, poll_fd_count, (pid_fd >= 0) ? -1 : 50);
+    if (ready == -1 && errno != EINTR) {
+      perror("foreground wait poll()");
+      result = waitpid(spawn_pid, child_status, 0);
+      break;
+    }
+    if (ready > 0) {
+      handle_event_poll_fds(poll_fds, first_event_fd, poll_fd_count);
+    }
+  }
+
+  if (pid_fd >= 0) {
+    close(pid_fd);
+  }
+  return result;
+}
+
+void give_terminal_to_process_group(pid_t pgid) {
+  // tcsetpgrp from a background process group raises SIGTTOU,
+  // block it for the duration of the handoff
+  sigset_t block_mask;
+  sigset_t old_mask;
+  sigemptyset(&block_mask);
+  sigaddset(&block_mask, SIGTTOU);
+  sigprocmask(SIG_BLOCK, &block_mask, &old_mask);
+  tcsetpgrp(STDIN_FILENO, pgid);
+  sigprocmask(SIG_SETMASK, &old_mask, NULL);
+}
+
 void print_foreground_process_status(struct Status *status) {
   if (status->fg_process_exit) {
     printf(
@@ -331,10 +951,17 @@ void print_foreground_process_status(struct Status *status) {
     );
     fflush(stdout);
   } else if (status->fg_process_terminated) {
+    char* deadline_note = "";
+    if (status->fg_process_killed_after_grace) {
+      deadline_note = " | Timed out, killed after grace period";
+    } else if (status->fg_process_timed_out) {
+      deadline_note = " | Timed out";
+    }
     printf(
-      "Child PID=%d | Abnormal Termination Status: %d\n",
+      "Child PID=%d | Abnormal Termination Status: %d%s\n",
       status->fg_process_pid,
-      status->fg_process_exit_or_term_reason
+      status->fg_process_exit_or_term_reason,
+      deadline_note
     );
     fflush(stdout);
   }
@@ -369,104 +996,1856 @@ void reap_terminated_child_processes(struct BackgroundPIDs *background_pids) {
       fflush(stdout);
       to_be_removed[to_be_removed_count] = i;
       to_be_removed_count += 1;
+      forget_coprocess(child_pid);
+      collect_exec_status(background_pids->exec_status_fds[i]);
+      bool timed_out = false;
+      bool killed_after_grace = false;
+      take_deadline_outcome(child_pid, &timed_out, &killed_after_grace);
+      if (!WIFEXITED(child_status)) {
+        atomic_fetch_add_explicit(&shell_metrics.jobs_killed_by_signal, 1, memory_order_relaxed);
+      }
+      if (spawn_trace.enabled) {
+        trace_exit(
+          child_pid,
+          background_pids->pgids[i],
+          child_status,
+          monotonic_time_ns() - background_pids->started_at_ns[i]
+        );
+      }
       if (WIFEXITED(child_status)) {
         printf("exit value %d\n", WEXITSTATUS(child_status));
         fflush(stdout);
+      } else if (killed_after_grace) {
+        printf("terminated by signal %d (timed out, killed after grace period)\n", WTERMSIG(child_status));
+        fflush(stdout);
+      } else if (timed_out) {
+        printf("terminated by signal %d (timed out)\n", WTERMSIG(child_status));
+        fflush(stdout);
       } else {
         printf("terminated by signal %d\n", WTERMSIG(child_status));
         fflush(stdout);
       }
     }
   }
-
-  // for every index captured in the to_be_removed array,
-  // get the index and shift the bg pids array to skip over the index
-  for (int i = 0; i < to_be_removed_count; i++) {
-    int index_for_removal = to_be_removed[i];
-    for (; index_for_removal < background_pids->size; index_for_removal++) {
-      background_pids->pids[index_for_removal] = background_pids->pids[index_for_removal + 1];
+
+  // shift the bg pids still running down over the ones in the
+  // to_be_removed array (which is in ascending order), in one pass
+  int kept_count = 0;
+  int removal_index = 0;
+  for (int i = 0; i < background_pids->size; i++) {
+    if (removal_index < to_be_removed_count && to_be_removed[removal_index] == i) {
+      removal_index += 1;
+      continue;
+    }
+    background_pids->pids[kept_count] = background_pids->pids[i];
+    background_pids->pgids[kept_count] = background_pids->pgids[i];
+    background_pids->started_at_ns[kept_count] = background_pids->started_at_ns[i];
+    background_pids->exec_status_fds[kept_count] = background_pids->exec_status_fds[i];
+    kept_count += 1;
+  }
+  // keep track of the number of removed bg pids
+  background_pids->size = kept_count;
+  atomic_store(&shell_metrics.background_jobs, background_pids->size);
+  return;
+}
+
+void initialize_background_pids_struct(struct BackgroundPIDs *background_pids) {
+  background_pids->size = 0;
+  background_pids->capacity = 0;
+  background_pids->pids = NULL;
+  background_pids->pgids = NULL;
+  background_pids->started_at_ns = NULL;
+  background_pids->exec_status_fds = NULL;
+}
+
+void add_background_pid(struct BackgroundPIDs *background_pids, pid_t pid, pid_t pgid, long long started_at_ns, int exec_status_fd) {
+  // no fixed limit on background jobs, the arrays double when full
+  if (background_pids->size == background_pids->capacity) {
+    int capacity = background_pids->capacity ? background_pids->capacity * 2 : 64;
+    pid_t* pids = realloc(background_pids->pids, capacity * sizeof(pid_t));
+    if (pids) {
+      background_pids->pids = pids;
+    }
+    pid_t* pgids = realloc(background_pids->pgids, capacity * sizeof(pid_t));
+    if (pgids) {
+      background_pids->pgids = pgids;
+    }
+    long long* started_at_ns_array = realloc(background_pids->started_at_ns, capacity * sizeof(long long));
+    if (started_at_ns_array) {
+      background_pids->started_at_ns = started_at_ns_array;
+    }
+    int* exec_status_fds = realloc(background_pids->exec_status_fds, capacity * sizeof(int));
+    if (exec_status_fds) {
+      background_pids->exec_status_fds = exec_status_fds;
+    }
+    if (!pids || !pgids || !started_at_ns_array || !exec_status_fds) {
+      perror("background pids realloc()");
+      exit(1);
+    }
+    background_pids->capacity = capacity;
+  }
+  background_pids->pids[background_pids->size] = pid;
+  background_pids->pgids[background_pids->size] = pgid;
+  background_pids->started_at_ns[background_pids->size] = started_at_ns;
+  background_pids->exec_status_fds[background_pids->size] = exec_status_fd;
+  background_pids->size += 1;
+}
+
+void free_background_pids_struct(struct BackgroundPIDs *background_pids) {
+  free(background_pids->pids);
+  free(background_pids->pgids);
+  free(background_pids->started_at_ns);
+  free(background_pids->exec_status_fds);
+  initialize_background_pids_struct(background_pids);
+}
+
+void raise_fd_limit() {
+  // every background job holds fds in the shell until it's reaped, and
+  // the soft limit (often 1024) would cap the number of jobs well below
+  // what the hard limit allows
+  if (getrlimit(RLIMIT_NOFILE, &original_fd_limit) == -1) {
+    perror("getrlimit()");
+    return;
+  }
+  struct rlimit raised_fd_limit = original_fd_limit;
+  raised_fd_limit.rlim_cur = raised_fd_limit.rlim_max;
+  if (setrlimit(RLIMIT_NOFILE, &raised_fd_limit) == -1) {
+    perror("setrlimit()");
+    return;
+  }
+  fd_limit_raised = true;
+}
+
+void collect_exec_status(int exec_status_fd) {
+  // called once the child is reaped: the pipe holds its execvp errno if
+  // exec failed, and is just at end of file if exec went through
+  if (exec_status_fd == -1) {
+    return;
+  }
+  int exec_errno;
+  ssize_t bytes_read;
+  do {
+    bytes_read = read(exec_status_fd, &exec_errno, sizeof(exec_errno));
+  } while (bytes_read == -1 && errno == EINTR);
+  if (bytes_read == sizeof(exec_errno)) {
+    atomic_fetch_add_explicit(&shell_metrics.exec_failures, 1, memory_order_relaxed);
+  }
+  close(exec_status_fd);
+}
+
+long long monotonic_time_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+bool add_deadline(pid_t pid, long long timeout_ms, long long grace_ms) {
+  // the timerfd is only created once the first deadline shows up
+  if (deadline_heap.timer_fd == -1) {
+    deadline_heap.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (deadline_heap.timer_fd == -1) {
+      perror("deadline timerfd_create()");
+      return false;
+    }
+    deadline_heap.timer_fd = move_fd_high(deadline_heap.timer_fd);
+  }
+
+  // find a free slot for the deadline
+  int slot = -1;
+  int capacity = sizeof(deadline_heap.deadlines) / sizeof(deadline_heap.deadlines[0]);
+  for (int i = 0; i < capacity; i++) {
+    if (!deadline_heap.deadlines[i].in_use) {
+      slot = i;
+      break;
+    }
+  }
+  if (slot == -1) {
+    return false;
+  }
+
+  struct Deadline *deadline = &deadline_heap.deadlines[slot];
+  deadline->in_use = true;
+  deadline->pid = pid;
+  deadline->expires_at_ns = monotonic_time_ns() + timeout_ms * 1000000LL;
+  deadline->grace_ns = grace_ms * 1000000LL;
+  deadline->timed_out = false;
+  deadline->killed_after_grace = false;
+
+  // push it onto the heap and re-arm in case it became the earliest one
+  deadline->heap_index = deadline_heap.size;
+  deadline_heap.heap[deadline_heap.size] = slot;
+  deadline_heap.size += 1;
+  deadline_heap_sift_up(deadline->heap_index);
+  arm_deadline_timer();
+  return true;
+}
+
+void take_deadline_outcome(pid_t pid, bool *timed_out, bool *killed_after_grace) {
+  // called once the job is reaped - reports what its deadline did
+  // and forgets about it, so a recycled pid can't be signalled later
+  int capacity = sizeof(deadline_heap.deadlines) / sizeof(deadline_heap.deadlines[0]);
+  for (int i = 0; i < capacity; i++) {
+    struct Deadline *deadline = &deadline_heap.deadlines[i];
+    if (deadline->in_use && deadline->pid == pid) {
+      *timed_out = deadline->timed_out;
+      *killed_after_grace = deadline->killed_after_grace;
+      if (deadline->heap_index >= 0) {
+        deadline_heap_remove(deadline->heap_index);
+        arm_deadline_timer();
+      }
+      deadline->in_use = false;
+      return;
+    }
+  }
+}
+
+void service_expired_deadlines() {
+  // drain the expiration count, we go by the clock not the count
+  uint64_t expirations;
+  while (read(deadline_heap.timer_fd, &expirations, sizeof(expirations)) > 0) {
+  }
+
+  long long now_ns = monotonic_time_ns();
+  while (deadline_heap.size) {
+    struct Deadline *deadline = &deadline_heap.deadlines[deadline_heap.heap[0]];
+    if (deadline->expires_at_ns > now_ns) {
+      break;
+    }
+    if (!deadline->timed_out) {
+      // first stage: ask the whole job nicely, SIGCONT in case it's stopped
+      kill(-deadline->pid, SIGTERM);
+      kill(-deadline->pid, SIGCONT);
+      if (spawn_trace.enabled) {
+        trace_signal(-deadline->pid, SIGTERM, "timeout");
+      }
+      deadline->timed_out = true;
+      deadline->expires_at_ns = now_ns + deadline->grace_ns;
+      deadline_heap_sift_down(0);
+    } else {
+      // second stage: the grace period ran out
+      kill(-deadline->pid, SIGKILL);
+      if (spawn_trace.enabled) {
+        trace_signal(-deadline->pid, SIGKILL, "timeout grace period");
+      }
+      deadline->killed_after_grace = true;
+      deadline_heap_remove(0);
+    }
+  }
+  arm_deadline_timer();
+}
+
+void arm_deadline_timer() {
+  if (deadline_heap.timer_fd == -1) {
+    return;
+  }
+  // an all zero it_value disarms the timer when the heap is empty
+  struct itimerspec timer_value = {0};
+  if (deadline_heap.size) {
+    long long expires_at_ns = deadline_heap.deadlines[deadline_heap.heap[0]].expires_at_ns;
+    timer_value.it_value.tv_sec = expires_at_ns / 1000000000LL;
+    timer_value.it_value.tv_nsec = expires_at_ns % 1000000000LL;
+  }
+  if (timerfd_settime(deadline_heap.timer_fd, TFD_TIMER_ABSTIME, &timer_value, NULL) == -1) {
+    perror("deadline timerfd_settime()");
+  }
+}
+
+void deadline_heap_swap(int a, int b) {
+  int slot_a = deadline_heap.heap[a];
+  int slot_b = deadline_heap.heap[b];
+  deadline_heap.heap[a] = slot_b;
+  deadline_heap.heap[b] = slot_a;
+  deadline_heap.deadlines[slot_b].heap_index = a;
+  deadline_heap.deadlines[slot_a].heap_index = b;
+}
+
+void deadline_heap_sift_up(int index) {
+  while (index > 0) {
+    int parent = (index - 1) / 2;
+    long long parent_ns = deadline_heap.deadlines[deadline_heap.heap[parent]].expires_at_ns;
+    long long index_ns = deadline_heap.deadlines[deadline_heap.heap[index]].expires_at_ns;
+    if (parent_ns <= index_ns) {
+      break;
+    }
+    deadline_heap_swap(parent, index);
+    index = parent;
+  }
+}
+
+void deadline_heap_sift_down(int index) {
+  while (true) {
+    int smallest = index;
+    int left = 2 * index + 1;
+    int right = 2 * index + 2;
+    if (left < deadline_heap.size &&
+        deadline_heap.deadlines[deadline_heap.heap[left]].expires_at_ns <
+        deadline_heap.deadlines[deadline_heap.heap[smallest]].expires_at_ns) {
+      smallest = left;
+    }
+    if (right < deadline_heap.size &&
+        deadline_heap.deadlines[deadline_heap.heap[right]].expires_at_ns <
+        deadline_heap.deadlines[deadline_heap.heap[smallest]].expires_at_ns) {
+      smallest = right;
+    }
+    if (smallest == index) {
+      break;
+    }
+    deadline_heap_swap(index, smallest);
+    index = smallest;
+  }
+}
+
+void deadline_heap_remove(int index) {
+  // move the last entry into the hole, then let it find its place
+  int slot = deadline_heap.heap[index];
+  int last = deadline_heap.size - 1;
+  deadline_heap_swap(index, last);
+  deadline_heap.size -= 1;
+  deadline_heap.deadlines[slot].heap_index = -1;
+  if (index < deadline_heap.size) {
+    deadline_heap_sift_up(index);
+    deadline_heap_sift_down(index);
+  }
+}
+
+void set_trace_output(char* file_name_ptr) {
+  // 'trace off' (or a bare 'trace') stops tracing, anything else
+  // is the file the JSONL events get appended to
+  if (spawn_trace.enabled) {
+    stop_spawn_trace();
+  }
+  if (strlen(file_name_ptr) == 0 || strcmp(file_name_ptr, "off") == 0) {
+    return;
+  }
+  int trace_fd = open(file_name_ptr, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+  if (trace_fd == -1) {
+    perror("trace open()");
+    return;
+  }
+  // the flusher keeps writing while in-process builtins have fds redirected
+  trace_fd = move_fd_high(trace_fd);
+  start_spawn_trace(trace_fd);
+}
+
+void start_spawn_trace(int trace_fd) {
+  spawn_trace.fd = trace_fd;
+  atomic_store(&spawn_trace.head, 0);
+  atomic_store(&spawn_trace.tail, 0);
+  atomic_store(&spawn_trace.dropped, 0);
+  atomic_store(&spawn_trace.stop, false);
+  sem_init(&spawn_trace.wakeup, 0, 0);
+  int result = pthread_create(&spawn_trace.flusher, NULL, spawn_trace_flusher, NULL);
+  if (result != 0) {
+    fprintf(stderr, "trace pthread_create(): %s\n", strerror(result));
+    fflush(stderr);
+    sem_destroy(&spawn_trace.wakeup);
+    close(trace_fd);
+    return;
+  }
+  spawn_trace.enabled = true;
+}
+
+void stop_spawn_trace() {
+  // the flusher drains whatever is left in the ring before it returns
+  spawn_trace.enabled = false;
+  atomic_store(&spawn_trace.stop, true);
+  sem_post(&spawn_trace.wakeup);
+  pthread_join(spawn_trace.flusher, NULL);
+  sem_destroy(&spawn_trace.wakeup);
+  close(spawn_trace.fd);
+}
+
+struct TraceEvent* reserve_trace_event() {
+  // single producer (the shell itself), single consumer (the flusher).
+  // when the ring is full the event is dropped and counted - the
+  // shell never waits on trace I/O
+  unsigned capacity = sizeof(spawn_trace.events) / sizeof(spawn_trace.events[0]);
+  unsigned head = atomic_load_explicit(&spawn_trace.head, memory_order_relaxed);
+  unsigned tail = atomic_load_explicit(&spawn_trace.tail, memory_order_acquire);
+  if (head - tail >= capacity) {
+    atomic_fetch_add_explicit(&spawn_trace.dropped, 1, memory_order_relaxed);
+    return NULL;
+  }
+  struct TraceEvent *event = &spawn_trace.events[head % capacity];
+  event->timestamp_ns = monotonic_time_ns();
+  event->code = 0;
+  event->signaled = false;
+  event->duration_ns = 0;
+  event->detail[0] = '\0';
+  return event;
+}
+
+void commit_trace_event() {
+  unsigned capacity = sizeof(spawn_trace.events) / sizeof(spawn_trace.events[0]);
+  unsigned head = atomic_load_explicit(&spawn_trace.head, memory_order_relaxed) + 1;
+  atomic_store_explicit(&spawn_trace.head, head, memory_order_release);
+  // only bother the flusher early once a quarter of the ring is filled,
+  // otherwise it picks the events up on its next periodic pass
+  unsigned tail = atomic_load_explicit(&spawn_trace.tail, memory_order_relaxed);
+  if (head - tail == capacity / 4) {
+    sem_post(&spawn_trace.wakeup);
+  }
+}
+
+void trace_spawn(pid_t pid, pid_t pgid, char arguments[]) {
+  struct TraceEvent *event = reserve_trace_event();
+  if (!event) {
+    return;
+  }
+  event->type = TRACE_SPAWN;
+  event->pid = pid;
+  event->pgid = pgid;
+  snprintf(event->detail, sizeof(event->detail), "%s", arguments);
+  commit_trace_event();
+}
+
+void trace_exit(pid_t pid, pid_t pgid, int child_status, long long duration_ns) {
+  struct TraceEvent *event = reserve_trace_event();
+  if (!event) {
+    return;
+  }
+  event->type = TRACE_EXIT;
+  event->pid = pid;
+  event->pgid = pgid;
+  event->signaled = !WIFEXITED(child_status);
+  event->code = event->signaled ? WTERMSIG(child_status) : WEXITSTATUS(child_status);
+  event->duration_ns = duration_ns;
+  commit_trace_event();
+}
+
+void trace_redirect(pid_t pid, int fd, char* file_name_ptr) {
+  struct TraceEvent *event = reserve_trace_event();
+  if (!event) {
+    return;
+  }
+  event->type = TRACE_REDIRECT;
+  event->pid = pid;
+  event->pgid = 0;
+  event->code = fd;
+  snprintf(event->detail, sizeof(event->detail), "%s", file_name_ptr);
+  commit_trace_event();
+}
+
+void trace_redirects(pid_t pid, struct Command *command_ptr) {
+  // duplications are recorded as '&n' in place of a path
+  for (int i = 0; i < command_ptr->redirect_count; i++) {
+    struct Redirect *redirect = &command_ptr->redirects[i];
+    char duplicate[16];
+    if (redirect->from_fd >= 0) {
+      snprintf(duplicate, sizeof(duplicate), "&%d", redirect->from_fd);
+    }
+    trace_redirect(pid, redirect->fd, (redirect->from_fd >= 0) ? duplicate : redirect->file);
+  }
+}
+
+void trace_signal(pid_t target, int signo, char* reason) {
+  // a negative target means the signal went to the process group -target
+  struct TraceEvent *event = reserve_trace_event();
+  if (!event) {
+    return;
+  }
+  event->type = TRACE_SIGNAL;
+  event->pid = (target < 0) ? 0 : target;
+  event->pgid = (target < 0) ? -target : 0;
+  event->code = signo;
+  snprintf(event->detail, sizeof(event->detail), "%s", reason);
+  commit_trace_event();
+}
+
+void* spawn_trace_flusher(void* unused) {
+  unsigned capacity = sizeof(spawn_trace.events) / sizeof(spawn_trace.events[0]);
+  char output_buffer[65536];
+  size_t output_length = 0;
+  bool stopping = false;
+
+  while (!stopping) {
+    // wake up on the size threshold, on stop, or every 200ms regardless
+    struct timespec wake_at;
+    clock_gettime(CLOCK_REALTIME, &wake_at);
+    wake_at.tv_nsec += 200000000L;
+    if (wake_at.tv_nsec >= 1000000000L) {
+      wake_at.tv_sec += 1;
+      wake_at.tv_nsec -= 1000000000L;
+    }
+    sem_timedwait(&spawn_trace.wakeup, &wake_at);
+    stopping = atomic_load(&spawn_trace.stop);
+
+    unsigned tail = atomic_load_explicit(&spawn_trace.tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&spawn_trace.head, memory_order_acquire);
+    for (; tail != head; tail++) {
+      // worst case every byte of the detail escapes to \u00XX (~12KB),
+      // flush first if an event like that might not fit
+      if (sizeof(output_buffer) - output_length < 16384) {
+        write_all(spawn_trace.fd, output_buffer, output_length);
+        output_length = 0;
+      }
+      output_length += format_trace_event(
+        &spawn_trace.events[tail % capacity],
+        output_buffer + output_length,
+        sizeof(output_buffer) - output_length
+      );
+      // hand the slot back to the producer
+      atomic_store_explicit(&spawn_trace.tail, tail + 1, memory_order_release);
+    }
+
+    unsigned long dropped = atomic_exchange(&spawn_trace.dropped, 0);
+    if (dropped) {
+      output_length += snprintf(
+        output_buffer + output_length,
+        sizeof(output_buffer) - output_length,
+        "{\"ts_ns\":%lld,\"event\":\"dropped\",\"count\":%lu}\n",
+        monotonic_time_ns(),
+        dropped
+      );
+    }
+    if (output_length) {
+      write_all(spawn_trace.fd, output_buffer, output_length);
+      output_length = 0;
+    }
+  }
+  return unused;
+}
+
+size_t format_trace_event(struct TraceEvent *event, char* output, size_t output_size) {
+  int length = 0;
+  switch (event->type) {
+    case TRACE_SPAWN: {
+      length = snprintf(
+        output, output_size,
+        "{\"ts_ns\":%lld,\"event\":\"spawn\",\"pid\":%d,\"pgid\":%d,\"argv\":[",
+        event->timestamp_ns, event->pid, event->pgid
+      );
+      // arguments are stored space separated, same as Command.arguments
+      bool first_argument = true;
+      char* argument_ptr = event->detail;
+      while (*argument_ptr) {
+        size_t argument_length = strcspn(argument_ptr, " ");
+        if (argument_length) {
+          if (!first_argument) {
+            output[length++] = ',';
+          }
+          length += format_json_string(argument_ptr, argument_length, output + length);
+          first_argument = false;
+        }
+        argument_ptr += argument_length;
+        if (*argument_ptr == ' ') {
+          argument_ptr++;
+        }
+      }
+      length += snprintf(output + length, output_size - length, "]}\n");
+      break;
+    }
+    case TRACE_EXIT: {
+      length = snprintf(
+        output, output_size,
+        "{\"ts_ns\":%lld,\"event\":\"exit\",\"pid\":%d,\"pgid\":%d,\"%s\":%d,\"duration_ns\":%lld}\n",
+        event->timestamp_ns, event->pid, event->pgid,
+        event->signaled ? "signal" : "exit_code", event->code,
+        event->duration_ns
+      );
+      break;
+    }
+    case TRACE_REDIRECT: {
+      length = snprintf(
+        output, output_size,
+        "{\"ts_ns\":%lld,\"event\":\"redirect\",\"pid\":%d,\"fd\":%d,\"path\":",
+        event->timestamp_ns, event->pid, event->code
+      );
+      length += format_json_string(event->detail, strlen(event->detail), output + length);
+      length += snprintf(output + length, output_size - length, "}\n");
+      break;
+    }
+    case TRACE_SIGNAL: {
+      length = snprintf(
+        output, output_size,
+        "{\"ts_ns\":%lld,\"event\":\"signal\",\"pid\":%d,\"pgid\":%d,\"signal\":%d,\"reason\":",
+        event->timestamp_ns, event->pid, event->pgid, event->code
+      );
+      length += format_json_string(event->detail, strlen(event->detail), output + length);
+      length += snprintf(output + length, output_size - length, "}\n");
+      break;
+    }
+  }
+  return length;
+}
+
+size_t format_json_string(char* string_text, size_t string_length, char* output) {
+  // caller makes sure there's room for the worst case (every byte \u00XX)
+  size_t length = 0;
+  output[length++] = '"';
+  for (size_t i = 0; i < string_length; i++) {
+    unsigned char c = string_text[i];
+    if (c == '"' || c == '\\') {
+      output[length++] = '\\';
+      output[length++] = c;
+    } else if (c < 0x20) {
+      length += sprintf(output + length, "\\u%04x", c);
+    } else {
+      output[length++] = c;
+    }
+  }
+  output[length++] = '"';
+  output[length] = '\0';
+  return length;
+}
+
+void write_all(int fd, char* buffer, size_t length) {
+  while (length) {
+    ssize_t written = write(fd, buffer, length);
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    buffer += written;
+    length -= written;
+  }
+}
+
+void observe_foreground_wait(long long wait_ns) {
+  atomic_fetch_add_explicit(&shell_metrics.fg_wait_count, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&shell_metrics.fg_wait_sum_ns, wait_ns, memory_order_relaxed);
+  // buckets are cumulative, the way prometheus wants them
+  int bucket_count = sizeof(fg_wait_bucket_bounds_ns) / sizeof(fg_wait_bucket_bounds_ns[0]);
+  for (int i = 0; i < bucket_count; i++) {
+    if (wait_ns <= fg_wait_bucket_bounds_ns[i]) {
+      atomic_fetch_add_explicit(&shell_metrics.fg_wait_buckets[i], 1, memory_order_relaxed);
+    }
+  }
+}
+
+void observe_parse_time(long long parse_ns) {
+  atomic_fetch_add_explicit(&shell_metrics.parse_count, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&shell_metrics.parse_sum_ns, parse_ns, memory_order_relaxed);
+}
+
+void print_shell_stats(char arguments[]) {
+  // 'stats' prints, 'stats export PATH [SECONDS]' / 'stats export off'
+  // controls the prometheus textfile
+  char* subcommand_ptr = strtok(arguments, " ");
+  if (subcommand_ptr && strcmp(subcommand_ptr, "export") == 0) {
+    char* path_ptr = strtok(NULL, " ");
+    char* interval_ptr = strtok(NULL, " ");
+    set_metrics_export(path_ptr, interval_ptr);
+    return;
+  } else if (subcommand_ptr) {
+    fprintf(stderr, "stats: unknown subcommand '%s'\n", subcommand_ptr);
+    fflush(stderr);
+    return;
+  }
+
+  double uptime_s = (monotonic_time_ns() - shell_metrics.started_at_ns) / 1e9;
+  unsigned long long spawns = atomic_load(&shell_metrics.spawns);
+  unsigned long long fg_wait_count = atomic_load(&shell_metrics.fg_wait_count);
+  unsigned long long parse_count = atomic_load(&shell_metrics.parse_count);
+  printf("uptime:                %.1fs\n", uptime_s);
+  printf("spawns:                %llu (%.2f/s)\n", spawns, uptime_s > 0 ? spawns / uptime_s : 0);
+  printf("exec failures:         %llu\n", (unsigned long long)atomic_load(&shell_metrics.exec_failures));
+  printf("background jobs:       %d\n", atomic_load(&shell_metrics.background_jobs));
+  printf("killed by signal:      %llu\n", (unsigned long long)atomic_load(&shell_metrics.jobs_killed_by_signal));
+  printf(
+    "foreground wait:       %llu waits, avg %.3fms\n",
+    fg_wait_count,
+    fg_wait_count ? atomic_load(&shell_metrics.fg_wait_sum_ns) / 1e6 / fg_wait_count : 0
+  );
+  printf(
+    "parse time:            %llu lines, avg %.3fus\n",
+    parse_count,
+    parse_count ? atomic_load(&shell_metrics.parse_sum_ns) / 1e3 / parse_count : 0
+  );
+  if (shell_metrics.exporting) {
+    printf("exporting to:          %s every %llds\n", shell_metrics.export_path, shell_metrics.export_interval_ms / 1000);
+  }
+  fflush(stdout);
+}
+
+void set_metrics_export(char* path_ptr, char* interval_ptr) {
+  if (shell_metrics.exporting) {
+    stop_metrics_export();
+  }
+  if (!path_ptr || strcmp(path_ptr, "off") == 0) {
+    return;
+  }
+  // node_exporter's textfile collector is scraped every 15s by default
+  long long interval_ms = 15000;
+  if (interval_ptr && (!parse_duration_ms(interval_ptr, &interval_ms) || interval_ms == 0)) {
+    fprintf(stderr, "stats: invalid export interval '%s'\n", interval_ptr);
+    fflush(stderr);
+    return;
+  }
+  if (strlen(path_ptr) >= sizeof(shell_metrics.export_path)) {
+    fprintf(stderr, "stats: export path too long\n");
+    fflush(stderr);
+    return;
+  }
+  strcpy(shell_metrics.export_path, path_ptr);
+  shell_metrics.export_interval_ms = interval_ms;
+  atomic_store(&shell_metrics.stop_export, false);
+  sem_init(&shell_metrics.export_wakeup, 0, 0);
+  int result = pthread_create(&shell_metrics.exporter, NULL, metrics_exporter, NULL);
+  if (result != 0) {
+    fprintf(stderr, "stats pthread_create(): %s\n", strerror(result));
+    fflush(stderr);
+    sem_destroy(&shell_metrics.export_wakeup);
+    return;
+  }
+  shell_metrics.exporting = true;
+}
+
+void stop_metrics_export() {
+  // the exporter writes the file one last time on its way out
+  shell_metrics.exporting = false;
+  atomic_store(&shell_metrics.stop_export, true);
+  sem_post(&shell_metrics.export_wakeup);
+  pthread_join(shell_metrics.exporter, NULL);
+  sem_destroy(&shell_metrics.export_wakeup);
+}
+
+void* metrics_exporter(void* unused) {
+  bool stopping = false;
+  while (!stopping) {
+    write_prometheus_metrics();
+
+    struct timespec wake_at;
+    clock_gettime(CLOCK_REALTIME, &wake_at);
+    wake_at.tv_sec += shell_metrics.export_interval_ms / 1000;
+    wake_at.tv_nsec += (shell_metrics.export_interval_ms % 1000) * 1000000L;
+    if (wake_at.tv_nsec >= 1000000000L) {
+      wake_at.tv_sec += 1;
+      wake_at.tv_nsec -= 1000000000L;
+    }
+    while (sem_timedwait(&shell_metrics.export_wakeup, &wake_at) == -1 && errno == EINTR) {
+    }
+    stopping = atomic_load(&shell_metrics.stop_export);
+  }
+  write_prometheus_metrics();
+  return unused;
+}
+
+void write_prometheus_metrics() {
+  char output_buffer[4096];
+  size_t length = format_prometheus_metrics(output_buffer, sizeof(output_buffer));
+
+  // write next to the target and rename over it, so the collector
+  // never reads a half written file
+  char temp_path[sizeof(shell_metrics.export_path) + 16];
+  snprintf(temp_path, sizeof(temp_path), "%s.%d.tmp", shell_metrics.export_path, smallsh_pid);
+  int temp_fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (temp_fd == -1) {
+    return;
+  }
+  write_all(temp_fd, output_buffer, length);
+  close(temp_fd);
+  if (rename(temp_path, shell_metrics.export_path) == -1) {
+    unlink(temp_path);
+  }
+}
+
+size_t format_prometheus_metrics(char* output, size_t output_size) {
+  int length = 0;
+  length += snprintf(output + length, output_size - length,
+    "# HELP smallsh_spawns_total Commands forked by the shell.\n"
+    "# TYPE smallsh_spawns_total counter\n"
+    "smallsh_spawns_total{pid=\"%d\"} %llu\n"
+    "# HELP smallsh_exec_failures_total Children whose execvp failed.\n"
+    "# TYPE smallsh_exec_failures_total counter\n"
+    "smallsh_exec_failures_total{pid=\"%d\"} %llu\n"
+    "# HELP smallsh_background_jobs Background jobs currently running.\n"
+    "# TYPE smallsh_background_jobs gauge\n"
+    "smallsh_background_jobs{pid=\"%d\"} %d\n"
+    "# HELP smallsh_jobs_killed_by_signal_total Jobs that ended on a signal.\n"
+    "# TYPE smallsh_jobs_killed_by_signal_total counter\n"
+    "smallsh_jobs_killed_by_signal_total{pid=\"%d\"} %llu\n"
+    "# HELP smallsh_parse_seconds Time spent parsing command lines.\n"
+    "# TYPE smallsh_parse_seconds summary\n"
+    "smallsh_parse_seconds_sum{pid=\"%d\"} %.9f\n"
+    "smallsh_parse_seconds_count{pid=\"%d\"} %llu\n"
+    "# HELP smallsh_foreground_wait_seconds Time spent waiting on foreground commands.\n"
+    "# TYPE smallsh_foreground_wait_seconds histogram\n",
+    smallsh_pid, (unsigned long long)atomic_load(&shell_metrics.spawns),
+    smallsh_pid, (unsigned long long)atomic_load(&shell_metrics.exec_failures),
+    smallsh_pid, atomic_load(&shell_metrics.background_jobs),
+    smallsh_pid, (unsigned long long)atomic_load(&shell_metrics.jobs_killed_by_signal),
+    smallsh_pid, atomic_load(&shell_metrics.parse_sum_ns) / 1e9,
+    smallsh_pid, (unsigned long long)atomic_load(&shell_metrics.parse_count)
+  );
+  int bucket_count = sizeof(fg_wait_bucket_bounds_ns) / sizeof(fg_wait_bucket_bounds_ns[0]);
+  for (int i = 0; i < bucket_count; i++) {
+    length += snprintf(output + length, output_size - length,
+      "smallsh_foreground_wait_seconds_bucket{pid=\"%d\",le=\"%g\"} %llu\n",
+      smallsh_pid,
+      fg_wait_bucket_bounds_ns[i] / 1e9,
+      (unsigned long long)atomic_load(&shell_metrics.fg_wait_buckets[i])
+    );
+  }
+  unsigned long long fg_wait_count = atomic_load(&shell_metrics.fg_wait_count);
+  length += snprintf(output + length, output_size - length,
+    "smallsh_foreground_wait_seconds_bucket{pid=\"%d\",le=\"+Inf\"} %llu\n"
+    "smallsh_foreground_wait_seconds_sum{pid=\"%d\"} %.9f\n"
+    "smallsh_foreground_wait_seconds_count{pid=\"%d\"} %llu\n",
+    smallsh_pid, fg_wait_count,
+    smallsh_pid, atomic_load(&shell_metrics.fg_wait_sum_ns) / 1e9,
+    smallsh_pid, fg_wait_count
+  );
+  return length;
+}
+
+void execute_memoized_command(
+  struct Command *command_ptr,
+  struct BackgroundPIDs *background_pids,
+  struct Status *status_ptr
+) {
+  // cache entries live in one file per key, named after the key's hash:
+  //   [captured stdout][key][trailer with exit code and lengths]
+  // a miss runs the command with stdout pointed at a temp entry,
+  // a hit copies the stored stdout out and never forks
+  char memo_dir[200];
+  char* key = NULL;
+  size_t key_length = 0;
+  if (!get_memo_directory(memo_dir, sizeof(memo_dir)) ||
+      !build_memo_key(command_ptr, &key, &key_length)) {
+    execute_command(command_ptr, background_pids, status_ptr);
+    free(key);
+    return;
+  }
+
+  char entry_path[232];
+  snprintf(entry_path, sizeof(entry_path), "%s/%016llx", memo_dir, (unsigned long long)fnv1a_hash(key, key_length));
+
+  int cached_exit_code;
+  if (replay_memo_entry(entry_path, key, key_length, command_ptr, &cached_exit_code)) {
+    status_ptr->fg_process_status = true;
+    status_ptr->fg_process_pid = 0;
+    status_ptr->fg_process_exit = true;
+    status_ptr->fg_process_terminated = false;
+    status_ptr->fg_process_exit_or_term_reason = cached_exit_code;
+    status_ptr->fg_process_timed_out = false;
+    status_ptr->fg_process_killed_after_grace = false;
+    free(key);
+    return;
+  }
+
+  // miss - run it for real with stdout going into a private temp entry,
+  // a redirect of our own after the command line's has the last word
+  struct Command memo_command = *command_ptr;
+  char temp_path[256];
+  snprintf(temp_path, sizeof(temp_path), "%s.%d.tmp", entry_path, smallsh_pid);
+  if (memo_command.redirect_count + 2 > sizeof(memo_command.redirects) / sizeof(memo_command.redirects[0])) {
+    execute_command(command_ptr, background_pids, status_ptr);
+    free(key);
+    return;
+  }
+  // the key only covers input from files, so without a '<' the command
+  // reads /dev/null rather than the shell's own stdin
+  bool reads_stdin = true;
+  for (int i = 0; i < memo_command.redirect_count; i++) {
+    if (memo_command.redirects[i].fd == STDIN_FILENO) {
+      reads_stdin = false;
+    }
+  }
+  if (reads_stdin) {
+    memmove(&memo_command.redirects[1], &memo_command.redirects[0], memo_command.redirect_count * sizeof(struct Redirect));
+    memo_command.redirects[0] = (struct Redirect){ .fd = STDIN_FILENO, .flags = O_RDONLY, .from_fd = -1, .file = "/dev/null" };
+    memo_command.redirect_count += 1;
+  }
+  add_redirect(&memo_command, STDOUT_FILENO, O_WRONLY | O_CREAT | O_TRUNC, -1, temp_path);
+  unsigned long long exec_failures = atomic_load(&shell_metrics.exec_failures);
+  status_ptr->fg_process_pid = 0;
+  execute_command(&memo_command, background_pids, status_ptr);
+
+  int temp_fd = open(temp_path, O_RDWR | O_CLOEXEC);
+  if (temp_fd == -1) {
+    // the child never got as far as the redirect
+    free(key);
+    return;
+  }
+  struct stat temp_stat;
+  fstat(temp_fd, &temp_stat);
+  // the command's other redirects have already done their work in the
+  // child, only its stdout still has to get where it was going
+  bool stdout_opened;
+  int stdout_fd = open_memo_stdout(command_ptr, &stdout_opened);
+  if (stdout_fd != -1) {
+    copy_memo_output(temp_fd, temp_stat.st_size, stdout_fd);
+    if (stdout_opened) {
+      close(stdout_fd);
+    }
+  }
+
+  // only clean exits are worth remembering, and not when the
+  // command couldn't be found at all - it may be installed later
+  bool cacheable = status_ptr->fg_process_exit &&
+    status_ptr->fg_process_pid != 0 &&
+    atomic_load(&shell_metrics.exec_failures) == exec_failures;
+  if (cacheable) {
+    char trailer[64];
+    int trailer_length = snprintf(
+      trailer, sizeof(trailer), memo_trailer_format,
+      status_ptr->fg_process_exit_or_term_reason,
+      (long long)key_length,
+      (long long)temp_stat.st_size
+    );
+    lseek(temp_fd, 0, SEEK_END);
+    write_all(temp_fd, key, key_length);
+    write_all(temp_fd, trailer, trailer_length);
+    // rename is atomic, concurrent shells see the old entry or the new one
+    cacheable = rename(temp_path, entry_path) == 0;
+  }
+  if (!cacheable) {
+    unlink(temp_path);
+  }
+  close(temp_fd);
+  free(key);
+
+  if (cacheable) {
+    evict_memo_entries(memo_dir);
+  }
+}
+
+bool get_memo_directory(char* memo_dir, size_t memo_dir_size) {
+  // SMALLSH_MEMO_DIR, else $XDG_CACHE_HOME/smallsh-memo, else ~/.cache/smallsh-memo
+  char* dir_ptr = getenv("SMALLSH_MEMO_DIR");
+  int length;
+  if (dir_ptr) {
+    length = snprintf(memo_dir, memo_dir_size, "%s", dir_ptr);
+  } else if (getenv("XDG_CACHE_HOME")) {
+    length = snprintf(memo_dir, memo_dir_size, "%s/smallsh-memo", getenv("XDG_CACHE_HOME"));
+  } else if (getenv("HOME")) {
+    length = snprintf(memo_dir, memo_dir_size, "%s/.cache/smallsh-memo", getenv("HOME"));
+  } else {
+    return false;
+  }
+  if (length >= memo_dir_size) {
+    fprintf(stderr, "memo: cache directory path too long, running uncached\n");
+    fflush(stderr);
+    return false;
+  }
+  if (!make_directories(memo_dir)) {
+    perror("memo mkdir()");
+    return false;
+  }
+  return true;
+}
+
+bool make_directories(char* path) {
+  // mkdir -p
+  char partial_path[256];
+  snprintf(partial_path, sizeof(partial_path), "%s", path);
+  for (char* slash_ptr = partial_path + 1; *slash_ptr; slash_ptr++) {
+    if (*slash_ptr == '/') {
+      *slash_ptr = '\0';
+      if (mkdir(partial_path, 0700) == -1 && errno != EEXIST) {
+        return false;
+      }
+      *slash_ptr = '/';
+    }
+  }
+  return mkdir(partial_path, 0700) == 0 || errno == EEXIST;
+}
+
+bool build_memo_key(struct Command *command_ptr, char** key, size_t* key_length) {
+  // everything a deterministic command's output can depend on:
+  // argv, the working directory (for relative paths), the selected
+  // environment variables and the identity of the '<' input file
+  FILE* key_stream = open_memstream(key, key_length);
+  if (!key_stream) {
+    return false;
+  }
+  fprintf(key_stream, "argv=%s\n", command_ptr->arguments);
+
+  char current_directory[4096];
+  if (getcwd(current_directory, sizeof(current_directory))) {
+    fprintf(key_stream, "cwd=%s\n", current_directory);
+  }
+
+  // SMALLSH_MEMO_ENV picks the variables, space or colon separated
+  char* env_names_ptr = getenv("SMALLSH_MEMO_ENV");
+  char env_names[1024];
+  snprintf(env_names, sizeof(env_names), "%s", env_names_ptr ? env_names_ptr : "PATH LANG LC_ALL");
+  char* save_ptr;
+  for (char* name_ptr = strtok_r(env_names, " :", &save_ptr); name_ptr; name_ptr = strtok_r(NULL, " :", &save_ptr)) {
+    char* value_ptr = getenv(name_ptr);
+    fprintf(key_stream, "env %s%s%s\n", name_ptr, value_ptr ? "=" : "", value_ptr ? value_ptr : "");
+  }
+
+  // every file the command can read from, by identity and mtime
+  bool input_ok = true;
+  for (int i = 0; i < command_ptr->redirect_count && input_ok; i++) {
+    struct Redirect *redirect = &command_ptr->redirects[i];
+    if (redirect->from_fd >= 0 || (redirect->flags & O_ACCMODE) == O_WRONLY) {
+      continue;
+    }
+    struct stat input_stat;
+    if (stat(redirect->file, &input_stat) == 0) {
+      fprintf(
+        key_stream, "input%d=%s dev=%llu ino=%llu size=%lld mtime=%lld.%09ld\n",
+        redirect->fd,
+        redirect->file,
+        (unsigned long long)input_stat.st_dev,
+        (unsigned long long)input_stat.st_ino,
+        (long long)input_stat.st_size,
+        (long long)input_stat.st_mtim.tv_sec,
+        input_stat.st_mtim.tv_nsec
+      );
+    } else {
+      // let the command itself complain about the missing input
+      input_ok = false;
+    }
+  }
+  fclose(key_stream);
+  return input_ok;
+}
+
+uint64_t fnv1a_hash(char* data, size_t length) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (unsigned char)data[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+bool replay_memo_entry(char* entry_path, char* key, size_t key_length, struct Command *command_ptr, int *exit_code) {
+  int entry_fd = open(entry_path, O_RDONLY | O_CLOEXEC);
+  if (entry_fd == -1) {
+    return false;
+  }
+  bool hit = false;
+  struct stat entry_stat;
+  char trailer[64];
+  int trailer_length = snprintf(trailer, sizeof(trailer), memo_trailer_format, 0, 0LL, 0LL);
+  long long stored_key_length;
+  long long stored_output_length;
+  if (fstat(entry_fd, &entry_stat) == 0 && entry_stat.st_size >= trailer_length &&
+      pread(entry_fd, trailer, trailer_length, entry_stat.st_size - trailer_length) == trailer_length) {
+    trailer[trailer_length] = '\0';
+    // the stored key must match ours byte for byte, a hash collision
+    // or a damaged entry is just a miss
+    if (sscanf(trailer, "smallsh-memo %d %lld %lld", exit_code, &stored_key_length, &stored_output_length) == 3 &&
+        stored_key_length == key_length &&
+        stored_output_length + stored_key_length + trailer_length == entry_stat.st_size) {
+      char* stored_key = malloc(key_length);
+      hit = pread(entry_fd, stored_key, key_length, stored_output_length) == key_length &&
+        memcmp(stored_key, key, key_length) == 0;
+      free(stored_key);
+    }
+  }
+  if (hit) {
+    // bump the mtime, eviction goes oldest mtime first
+    futimens(entry_fd, NULL);
+    lseek(entry_fd, 0, SEEK_SET);
+    // nothing runs, so the command line's redirects are applied here
+    // just as the command would have had them
+    struct SavedFds saved_fds = { .count = 0 };
+    hit = apply_redirects(command_ptr, &saved_fds) &&
+      copy_memo_output(entry_fd, stored_output_length, STDOUT_FILENO);
+    restore_redirects(&saved_fds);
+  }
+  close(entry_fd);
+  return hit;
+}
+
+bool copy_memo_output(int from_fd, off_t length, int to_fd) {
+  fflush(stdout);
+  char buffer[65536];
+  lseek(from_fd, 0, SEEK_SET);
+  while (length > 0) {
+    ssize_t bytes_read = read(from_fd, buffer, (length < sizeof(buffer)) ? length : sizeof(buffer));
+    if (bytes_read == -1 && errno == EINTR) {
+      continue;
+    }
+    if (bytes_read <= 0) {
+      break;
+    }
+    write_all(to_fd, buffer, bytes_read);
+    length -= bytes_read;
+  }
+  return length == 0;
+}
+
+int open_memo_stdout(struct Command *command_ptr, bool *opened) {
+  // follows the redirects to find where fd 1 ended up, without replaying
+  // them. destinations[n] >= 0 is one of the shell's own fds, -(i + 1)
+  // is the file of redirects[i]
+  int destinations[10];
+  for (int fd = 0; fd < 10; fd++) {
+    destinations[fd] = fd;
+  }
+  for (int i = 0; i < command_ptr->redirect_count; i++) {
+    struct Redirect *redirect = &command_ptr->redirects[i];
+    if (redirect->from_fd < 0) {
+      destinations[redirect->fd] = -(i + 1);
+    } else if (redirect->from_fd < 10) {
+      destinations[redirect->fd] = destinations[redirect->from_fd];
+    } else {
+      // a coprocess pipe
+      destinations[redirect->fd] = redirect->from_fd;
+    }
+  }
+  *opened = false;
+  if (destinations[STDOUT_FILENO] >= 0) {
+    return destinations[STDOUT_FILENO];
+  }
+  // the child already created (and maybe truncated) the file and may
+  // have written stderr into it, so add to it rather than start over
+  struct Redirect *redirect = &command_ptr->redirects[-destinations[STDOUT_FILENO] - 1];
+  int flags = redirect->flags;
+  if (flags & O_TRUNC) {
+    flags = (flags & ~O_TRUNC) | O_APPEND;
+  }
+  int stdout_fd = open(redirect->file, flags | O_CLOEXEC, 0666);
+  if (stdout_fd == -1) {
+    perror(redirect->file);
+    return -1;
+  }
+  *opened = true;
+  return stdout_fd;
+}
+
+int compare_memo_entries_by_age(const void* a, const void* b) {
+  long long a_mtime_ns = ((struct MemoEntry*)a)->mtime_ns;
+  long long b_mtime_ns = ((struct MemoEntry*)b)->mtime_ns;
+  return (a_mtime_ns > b_mtime_ns) - (a_mtime_ns < b_mtime_ns);
+}
+
+void evict_memo_entries(char* memo_dir) {
+  // least recently used entries go first until the cache fits in
+  // SMALLSH_MEMO_MAX_BYTES (64MB by default)
+  long long max_bytes = 64LL * 1024 * 1024;
+  if (getenv("SMALLSH_MEMO_MAX_BYTES")) {
+    max_bytes = atoll(getenv("SMALLSH_MEMO_MAX_BYTES"));
+  }
+
+  // one evicting shell at a time, the others just carry on
+  char lock_path[256];
+  snprintf(lock_path, sizeof(lock_path), "%s/.lock", memo_dir);
+  int lock_fd = open(lock_path, O_RDONLY | O_CREAT | O_CLOEXEC, 0600);
+  if (lock_fd == -1) {
+    return;
+  }
+  if (flock(lock_fd, LOCK_EX | LOCK_NB) == -1) {
+    close(lock_fd);
+    return;
+  }
+
+  DIR* dir_ptr = opendir(memo_dir);
+  if (!dir_ptr) {
+    close(lock_fd);
+    return;
+  }
+  struct MemoEntry *entries = NULL;
+  int entry_count = 0;
+  int entry_capacity = 0;
+  long long total_bytes = 0;
+  long long now_s = time(NULL);
+  struct dirent *dir_entry;
+  while ((dir_entry = readdir(dir_ptr)) != NULL) {
+    if (dir_entry->d_name[0] == '.') {
+      continue;
+    }
+    struct stat entry_stat;
+    if (fstatat(dirfd(dir_ptr), dir_entry->d_name, &entry_stat, 0) == -1) {
+      continue;
+    }
+    // temp entries are only ours to clean up once their shell is long gone
+    if (strstr(dir_entry->d_name, ".tmp")) {
+      if (now_s - entry_stat.st_mtim.tv_sec > 3600) {
+        unlinkat(dirfd(dir_ptr), dir_entry->d_name, 0);
+      }
+      continue;
+    }
+    if (entry_count == entry_capacity) {
+      entry_capacity = entry_capacity ? entry_capacity * 2 : 64;
+      entries = realloc(entries, entry_capacity * sizeof(struct MemoEntry));
+    }
+    snprintf(entries[entry_count].name, sizeof(entries[entry_count].name), "%s", dir_entry->d_name);
+    entries[entry_count].size = entry_stat.st_size;
+    entries[entry_count].mtime_ns = (long long)entry_stat.st_mtim.tv_sec * 1000000000LL + entry_stat.st_mtim.tv_nsec;
+    total_bytes += entry_stat.st_size;
+    entry_count += 1;
+  }
+
+  if (total_bytes > max_bytes) {
+    qsort(entries, entry_count, sizeof(struct MemoEntry), compare_memo_entries_by_age);
+    for (int i = 0; i < entry_count && total_bytes > max_bytes; i++) {
+      // another shell may have removed it already, that's fine
+      unlinkat(dirfd(dir_ptr), entries[i].name, 0);
+      total_bytes -= entries[i].size;
+    }
+  }
+  free(entries);
+  closedir(dir_ptr);
+  close(lock_fd);
+}
+
+int find_loaded_builtin(char* token_ptr) {
+  for (int i = 0; i < loaded_builtins.size; i++) {
+    if (strcmp(loaded_builtins.builtins[i].name, token_ptr) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void enable_builtin(char arguments[]) {
+  // 'enable' lists the builtins, 'enable -f lib.so name' loads one,
+  // 'enable -d name' unloads it again
+  char* option_ptr = strtok(arguments, " ");
+  if (!option_ptr) {
+    for (int slot = 0; slot < 32; slot++) {
+      if (core_builtins[slot].name && isalpha(core_builtins[slot].name[0])) {
+        printf("enable %s\n", core_builtins[slot].name);
+      }
+    }
+    for (int i = 0; i < loaded_builtins.size; i++) {
+      printf("enable -f %s %s\n", loaded_builtins.builtins[i].library_path, loaded_builtins.builtins[i].name);
+    }
+    fflush(stdout);
+  } else if (strcmp(option_ptr, "-f") == 0) {
+    char* library_ptr = strtok(NULL, " ");
+    char* name_ptr = strtok(NULL, " ");
+    if (!library_ptr || !name_ptr) {
+      fprintf(stderr, "enable: usage: enable -f library.so name\n");
+      fflush(stderr);
+      return;
+    }
+    load_builtin(library_ptr, name_ptr);
+  } else if (strcmp(option_ptr, "-d") == 0) {
+    char* name_ptr = strtok(NULL, " ");
+    int index = name_ptr ? find_loaded_builtin(name_ptr) : -1;
+    if (index == -1) {
+      fprintf(stderr, "enable: %s: not a loaded builtin\n", name_ptr ? name_ptr : "");
+      fflush(stderr);
+      return;
+    }
+    unload_builtin(index);
+  } else {
+    fprintf(stderr, "enable: unknown option '%s'\n", option_ptr);
+    fflush(stderr);
+  }
+}
+
+void load_builtin(char* library_ptr, char* name_ptr) {
+  if (find_core_builtin(name_ptr) != NOT_A_BUILTIN) {
+    fprintf(stderr, "enable: %s: can't replace a core builtin\n", name_ptr);
+    fflush(stderr);
+    return;
+  }
+  int capacity = sizeof(loaded_builtins.builtins) / sizeof(loaded_builtins.builtins[0]);
+  int existing_index = find_loaded_builtin(name_ptr);
+  if (existing_index == -1 && loaded_builtins.size == capacity) {
+    fprintf(stderr, "enable: too many loaded builtins\n");
+    fflush(stderr);
+    return;
+  }
+  if (strlen(name_ptr) >= sizeof(loaded_builtins.builtins[0].name) ||
+      strlen(library_ptr) >= sizeof(loaded_builtins.builtins[0].library_path)) {
+    fprintf(stderr, "enable: name or library path too long\n");
+    fflush(stderr);
+    return;
+  }
+
+  void* library = dlopen(library_ptr, RTLD_NOW | RTLD_LOCAL);
+  if (!library) {
+    fprintf(stderr, "enable: %s\n", dlerror());
+    fflush(stderr);
+    return;
+  }
+  char symbol_name[128];
+  snprintf(symbol_name, sizeof(symbol_name), "smallsh_builtin_%s", name_ptr);
+  struct smallsh_builtin *builtin = dlsym(library, symbol_name);
+  if (!builtin || builtin->abi_version != SMALLSH_BUILTIN_ABI_VERSION || !builtin->run) {
+    fprintf(
+      stderr,
+      builtin ? "enable: %s: built for another smallsh builtin ABI\n" : "enable: %s: no such builtin in library\n",
+      name_ptr
+    );
+    fflush(stderr);
+    dlclose(library);
+    return;
+  }
+
+  // loading a name again swaps in the new version
+  if (existing_index != -1) {
+    unload_builtin(existing_index);
+  }
+  struct LoadedBuiltin *loaded = &loaded_builtins.builtins[loaded_builtins.size];
+  strcpy(loaded->name, name_ptr);
+  strcpy(loaded->library_path, library_ptr);
+  loaded->library = library;
+  loaded->builtin = builtin;
+  loaded_builtins.size += 1;
+}
+
+void unload_builtin(int index) {
+  dlclose(loaded_builtins.builtins[index].library);
+  for (; index < loaded_builtins.size - 1; index++) {
+    loaded_builtins.builtins[index] = loaded_builtins.builtins[index + 1];
+  }
+  loaded_builtins.size -= 1;
+}
+
+int run_loaded_builtin(struct Command *command_ptr) {
+  // argv for the builtin, built the same way as for execvp
+  char** arg_array = create_arguments_array(command_ptr->arguments);
+  int argc = 0;
+  while (arg_array[argc] != NULL) {
+    argc += 1;
+  }
+  int exit_code = loaded_builtins.builtins[command_ptr->loaded_builtin].builtin->run(argc, arg_array);
+  fflush(stdout);
+  fflush(stderr);
+  free(arg_array);
+  return exit_code;
+}
+
+void execute_loaded_builtin(struct Command *command_ptr, struct Status *status_ptr) {
+  // runs in the shell itself, its redirects are already in place
+  int exit_code = run_loaded_builtin(command_ptr);
+  status_ptr->fg_process_status = true;
+  status_ptr->fg_process_pid = 0;
+  status_ptr->fg_process_exit = true;
+  status_ptr->fg_process_terminated = false;
+  status_ptr->fg_process_exit_or_term_reason = exit_code;
+  status_ptr->fg_process_timed_out = false;
+  status_ptr->fg_process_killed_after_grace = false;
+}
+
+void start_coprocess(struct Command *command_ptr, struct BackgroundPIDs *background_pids, struct Status *status_ptr) {
+  // 'coproc' on its own lists them
+  if (command_ptr->coproc_name[0] == '\0') {
+    for (int i = 0; i < coprocesses.size; i++) {
+      struct Coprocess *coproc = &coprocesses.coprocs[i];
+      printf(
+        "%s pid %d ${%s[0]}=%d ${%s[1]}=%d\n",
+        coproc->name, coproc->pid, coproc->name, coproc->read_fd, coproc->name, coproc->write_fd
+      );
+    }
+    fflush(stdout);
+    return;
+  }
+  if (!command_ptr->other_command) {
+    fprintf(stderr, "coproc: %s: missing command\n", command_ptr->coproc_name);
+    fflush(stderr);
+    return;
+  }
+  if (find_coprocess(command_ptr->coproc_name)) {
+    fprintf(stderr, "coproc: %s is already running\n", command_ptr->coproc_name);
+    fflush(stderr);
+    return;
+  }
+  int max_redirects = sizeof(command_ptr->redirects) / sizeof(command_ptr->redirects[0]);
+  if (coprocesses.size == sizeof(coprocesses.coprocs) / sizeof(coprocesses.coprocs[0]) ||
+      command_ptr->redirect_count + 2 > max_redirects) {
+    fprintf(stderr, "coproc: %s: too many coprocesses or redirects\n", command_ptr->coproc_name);
+    fflush(stderr);
+    return;
+  }
+  int to_coproc[2];
+  int from_coproc[2];
+  if (internal_pipe(to_coproc) == -1) {
+    perror("coproc pipe2()");
+    return;
+  }
+  if (internal_pipe(from_coproc) == -1) {
+    perror("coproc pipe2()");
+    close(to_coproc[0]);
+    close(to_coproc[1]);
+    return;
+  }
+
+  // its stdin and stdout go first, so the command line's own redirects
+  // can still send either of them elsewhere
+  memmove(&command_ptr->redirects[2], &command_ptr->redirects[0], command_ptr->redirect_count * sizeof(struct Redirect));
+  command_ptr->redirects[0] = (struct Redirect){ .fd = STDIN_FILENO, .flags = 0, .from_fd = to_coproc[0], .file = "" };
+  command_ptr->redirects[1] = (struct Redirect){ .fd = STDOUT_FILENO, .flags = 0, .from_fd = from_coproc[1], .file = "" };
+  command_ptr->redirect_count += 2;
+  int jobs_before = background_pids->size;
+  execute_command(command_ptr, background_pids, status_ptr);
+  close(to_coproc[0]);
+  close(from_coproc[1]);
+  if (background_pids->size == jobs_before) {
+    close(to_coproc[1]);
+    close(from_coproc[0]);
+    return;
+  }
+
+  struct Coprocess *coproc = &coprocesses.coprocs[coprocesses.size];
+  strcpy(coproc->name, command_ptr->coproc_name);
+  coproc->pid = background_pids->pids[background_pids->size - 1];
+  coproc->read_fd = from_coproc[0];
+  coproc->write_fd = to_coproc[1];
+  coprocesses.size += 1;
+}
+
+struct Coprocess* find_coprocess(char* name_ptr) {
+  for (int i = 0; i < coprocesses.size; i++) {
+    if (strcmp(coprocesses.coprocs[i].name, name_ptr) == 0) {
+      return &coprocesses.coprocs[i];
+    }
+  }
+  return NULL;
+}
+
+void forget_coprocess(pid_t pid) {
+  // once it's reaped its pipes go too, whatever it wrote and nobody read is lost
+  for (int i = 0; i < coprocesses.size; i++) {
+    if (coprocesses.coprocs[i].pid == pid) {
+      close(coprocesses.coprocs[i].read_fd);
+      close(coprocesses.coprocs[i].write_fd);
+      coprocesses.coprocs[i] = coprocesses.coprocs[coprocesses.size - 1];
+      coprocesses.size -= 1;
+      return;
+    }
+  }
+}
+
+bool parse_coprocess_fd(char* reference_ptr, long *fd) {
+  // ${NAME[0]} reads what the coprocess writes, ${NAME[1]} writes to its stdin
+  char* index_ptr = strchr(reference_ptr, '[');
+  if (strncmp(reference_ptr, "${", 2) != 0 || !index_ptr ||
+      (index_ptr[1] != '0' && index_ptr[1] != '1') || strcmp(index_ptr + 2, "]}") != 0) {
+    fprintf(stderr, "%s: expected ${NAME[0]} or ${NAME[1]}\n", reference_ptr);
+    fflush(stderr);
+    return false;
+  }
+  char name[64];
+  size_t name_length = index_ptr - (reference_ptr + 2);
+  if (name_length >= sizeof(name)) {
+    name_length = sizeof(name) - 1;
+  }
+  memcpy(name, reference_ptr + 2, name_length);
+  name[name_length] = '\0';
+  struct Coprocess *coproc = find_coprocess(name);
+  if (!coproc) {
+    fprintf(stderr, "%s: no such coprocess\n", name);
+    fflush(stderr);
+    return false;
+  }
+  *fd = (index_ptr[1] == '0') ? coproc->read_fd : coproc->write_fd;
+  return true;
+}
+
+int move_fd_high(int fd) {
+  // the shell's own long-lived fds go to 10 and up, out of reach of the
+  // 0-9 a redirect can name - a child (or an in-process builtin) with
+  // '4> file' mustn't end up writing into one of them
+  if (fd == -1 || fd >= 10) {
+    return fd;
+  }
+  int high_fd = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+  if (high_fd == -1) {
+    perror("move fd fcntl()");
+    return fd;
+  }
+  close(fd);
+  return high_fd;
+}
+
+int internal_pipe(int pipe_fds[2]) {
+  if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+    return -1;
+  }
+  pipe_fds[0] = move_fd_high(pipe_fds[0]);
+  pipe_fds[1] = move_fd_high(pipe_fds[1]);
+  return 0;
+}
+
+void set_any_redirects(struct Command *command_ptr, int capture_fd) {
+  // defaults first - background commands don't get to read from the
+  // terminal, and write into their joblog capture pipe
+  if (command_ptr->background) {
+    int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (null_fd == -1 || dup2(null_fd, STDIN_FILENO) == -1) {
+      perror("/dev/null");
+      exit(1);
+    }
+    close(null_fd);
+  }
+  if (capture_fd != -1) {
+    dup2(capture_fd, STDOUT_FILENO);
+    dup2(capture_fd, STDERR_FILENO);
+  }
+  // then the command line's own
+  if (!apply_redirects(command_ptr, NULL)) {
+    exit(1);
+  }
+}
+
+bool apply_redirects(struct Command *command_ptr, struct SavedFds *saved_fds) {
+  // in order, so '> file 2>&1' and '2>&1 > file' differ the way they do
+  // in sh. files are opened O_CLOEXEC and closed once dup2'd into place,
+  // only the redirected fd itself survives an exec.
+  // saved_fds is NULL in a child, which has nothing to put back
+  fflush(stdout);
+  fflush(stderr);
+  for (int i = 0; i < command_ptr->redirect_count; i++) {
+    struct Redirect *redirect = &command_ptr->redirects[i];
+    if (saved_fds && !save_redirected_fd(saved_fds, redirect->fd)) {
+      return false;
+    }
+    int from_fd = redirect->from_fd;
+    if (from_fd < 0) {
+      from_fd = open(redirect->file, redirect->flags | O_CLOEXEC, 0666);
+      if (from_fd == -1) {
+        perror(redirect->file);
+        return false;
+      }
+    }
+    if (from_fd == redirect->fd) {
+      // already in place ('n>&n', or open() handed back the fd itself),
+      // it only has to stay open across exec
+      if (fcntl(redirect->fd, F_SETFD, 0) == -1) {
+        fprintf(stderr, "%d>&%d: %s\n", redirect->fd, from_fd, strerror(errno));
+        fflush(stderr);
+        return false;
+      }
+    } else if (dup2(from_fd, redirect->fd) == -1) {
+      if (redirect->from_fd < 0) {
+        perror(redirect->file);
+        close(from_fd);
+      } else {
+        fprintf(stderr, "%d>&%d: %s\n", redirect->fd, from_fd, strerror(errno));
+        fflush(stderr);
+      }
+      return false;
+    } else if (redirect->from_fd < 0) {
+      close(from_fd);
+    }
+  }
+  return true;
+}
+
+bool save_redirected_fd(struct SavedFds *saved_fds, int fd) {
+  // only the first redirect of an fd saves it, that's what gets restored
+  for (int i = 0; i < saved_fds->count; i++) {
+    if (saved_fds->fds[i] == fd) {
+      return true;
+    }
+  }
+  int fd_flags = fcntl(fd, F_GETFD);
+  int saved_fd = -1;
+  if (fd_flags != -1) {
+    // kept above the low fds the redirects are likely to use
+    saved_fd = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+    if (saved_fd == -1) {
+      perror("redirect save fd");
+      return false;
     }
-    // keep track of the number of removed bg pids
-    background_pids->size -= 1;
   }
-  return;
+  saved_fds->fds[saved_fds->count] = fd;
+  saved_fds->saved[saved_fds->count] = saved_fd;
+  saved_fds->fd_flags[saved_fds->count] = fd_flags;
+  saved_fds->count += 1;
+  return true;
 }
 
-void initialize_background_pids_struct(struct BackgroundPIDs *background_pids) {
-  background_pids->size = 0;
+void restore_redirects(struct SavedFds *saved_fds) {
+  if (saved_fds->count == 0) {
+    return;
+  }
+  fflush(stdout);
+  fflush(stderr);
+  for (int i = saved_fds->count - 1; i >= 0; i--) {
+    int fd = saved_fds->fds[i];
+    if (saved_fds->saved[i] == -1) {
+      close(fd);
+    } else {
+      // dup3 so a shell fd that was close-on-exec stays that way
+      dup3(saved_fds->saved[i], fd, (saved_fds->fd_flags[i] & FD_CLOEXEC) ? O_CLOEXEC : 0);
+      close(saved_fds->saved[i]);
+    }
+    if (fd == STDIN_FILENO) {
+      // whatever stdio read ahead belonged to the redirected file
+      __fpurge(stdin);
+    }
+  }
+  saved_fds->count = 0;
 }
 
-void set_any_redirects(struct Command *command_ptr) {
-  if (!command_ptr->background) {
-    if (command_ptr->output_redirect) {
-      set_output_redirect_fg(command_ptr->output_file); 
+struct JobOutput* start_job_output(int job_number, pid_t pid, int pipe_fd) {
+  // reuse the slot of an older job with the same number, else a free
+  // slot, else the finished job that started longest ago
+  int capacity = sizeof(job_outputs.jobs) / sizeof(job_outputs.jobs[0]);
+  struct JobOutput *job_output = NULL;
+  for (int i = 0; i < capacity && !job_output; i++) {
+    if (job_outputs.jobs[i].in_use && job_outputs.jobs[i].job_number == job_number &&
+        job_outputs.jobs[i].pipe_fd == -1) {
+      job_output = &job_outputs.jobs[i];
     }
-    if(command_ptr->input_redirect) {
-      set_input_redirect_fg(command_ptr->input_file);
+  }
+  for (int i = 0; i < capacity && !job_output; i++) {
+    if (!job_outputs.jobs[i].in_use) {
+      job_output = &job_outputs.jobs[i];
     }
-  } else {
-    if (command_ptr->output_redirect) {
-      set_output_redirect_bg();
+  }
+  if (!job_output) {
+    for (int i = 0; i < capacity; i++) {
+      struct JobOutput *candidate = &job_outputs.jobs[i];
+      if (candidate->pipe_fd == -1 && (!job_output || candidate->sequence < job_output->sequence)) {
+        job_output = candidate;
+      }
     }
-    if (command_ptr->input_redirect) {
-      set_input_redirect_bg();
+  }
+  // every slot belongs to a job that's still writing
+  if (!job_output) {
+    return NULL;
+  }
+  if (job_output->in_use) {
+    discard_job_output(job_output);
+  }
+
+  job_output->in_use = true;
+  job_output->job_number = job_number;
+  job_output->pid = pid;
+  job_output->sequence = ++job_outputs.sequence;
+  job_output->pipe_fd = pipe_fd;
+  job_output->capacity = job_outputs.capacity_setting;
+  job_output->ring = malloc(job_output->capacity);
+  if (!job_output->ring) {
+    job_output->in_use = false;
+    return NULL;
+  }
+  job_output->start = 0;
+  job_output->length = 0;
+  job_output->total_bytes = 0;
+  job_output->overflow_bytes = 0;
+  job_output->spill_fd = -1;
+  job_output->spill_path[0] = '\0';
+  fcntl(pipe_fd, F_SETFL, fcntl(pipe_fd, F_GETFL) | O_NONBLOCK);
+  job_outputs.open_pipes += 1;
+  return job_output;
+}
+
+void discard_job_output(struct JobOutput *job_output) {
+  if (job_output->pipe_fd != -1) {
+    close(job_output->pipe_fd);
+    job_output->pipe_fd = -1;
+    job_outputs.open_pipes -= 1;
+  }
+  if (job_output->spill_fd != -1) {
+    close(job_output->spill_fd);
+    job_output->spill_fd = -1;
+  }
+  free(job_output->ring);
+  job_output->ring = NULL;
+  job_output->in_use = false;
+}
+
+void drain_job_output(struct JobOutput *job_output) {
+  // read whatever the pipe has right now, never waits for more
+  char buffer[65536];
+  while (job_output->pipe_fd != -1) {
+    ssize_t bytes_read = read(job_output->pipe_fd, buffer, sizeof(buffer));
+    if (bytes_read > 0) {
+      append_job_output(job_output, buffer, bytes_read);
+    } else if (bytes_read == -1 && errno == EINTR) {
+      continue;
+    } else if (bytes_read == -1 && errno == EAGAIN) {
+      break;
+    } else {
+      // end of output - every process in the job has closed its end
+      close(job_output->pipe_fd);
+      job_output->pipe_fd = -1;
+      job_outputs.open_pipes -= 1;
     }
   }
 }
 
-void set_output_redirect_bg() {
-  int output_fd = open("/dev/null", O_WRONLY);
-  if (output_fd == -1) {
-    perror("output_fd_bg open()");
-    exit(6);
+void append_job_output(struct JobOutput *job_output, char* data, size_t length) {
+  job_output->total_bytes += length;
+  // a chunk bigger than the whole ring only keeps its tail
+  if (length >= job_output->capacity) {
+    overflow_job_output(job_output, job_output->length);
+    spill_job_output(job_output, data, length - job_output->capacity);
+    data += length - job_output->capacity;
+    length = job_output->capacity;
+  } else if (job_output->length + length > job_output->capacity) {
+    overflow_job_output(job_output, job_output->length + length - job_output->capacity);
+  }
+  size_t write_at = (job_output->start + job_output->length) % job_output->capacity;
+  size_t first_part = job_output->capacity - write_at;
+  if (first_part > length) {
+    first_part = length;
   }
-  int result = dup2(output_fd, STDOUT_FILENO);
-  if (result == -1) {
-    perror("output_fd_bg dup2()");
-    exit(7);
+  memcpy(job_output->ring + write_at, data, first_part);
+  memcpy(job_output->ring, data + first_part, length - first_part);
+  job_output->length += length;
+}
+
+void overflow_job_output(struct JobOutput *job_output, size_t length) {
+  // the oldest bytes make room - spilled if there's somewhere to spill them
+  size_t first_part = job_output->capacity - job_output->start;
+  if (first_part > length) {
+    first_part = length;
   }
+  spill_job_output(job_output, job_output->ring + job_output->start, first_part);
+  spill_job_output(job_output, job_output->ring, length - first_part);
+  job_output->start = (job_output->start + length) % job_output->capacity;
+  job_output->length -= length;
 }
 
-void set_input_redirect_bg() {
-  int input_fd = open("/dev/null", O_RDONLY);
-  if (input_fd == -1) {
-    perror("input_fd_bg open()");
-    exit(8);
+void spill_job_output(struct JobOutput *job_output, char* data, size_t length) {
+  if (length == 0) {
+    return;
   }
-  int result = dup2(input_fd, STDIN_FILENO);
-  if (result == -1) {
-    perror("input_fd_bg dup2()");
-    exit(9);
+  job_output->overflow_bytes += length;
+  if (job_output->spill_fd == -1 && job_outputs.spill_dir[0] && job_output->spill_path[0] == '\0') {
+    snprintf(
+      job_output->spill_path, sizeof(job_output->spill_path),
+      "%s/smallsh-%d-job%d-%d.log",
+      job_outputs.spill_dir, smallsh_pid, job_output->job_number, job_output->pid
+    );
+    job_output->spill_fd = move_fd_high(open(job_output->spill_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+    if (job_output->spill_fd == -1) {
+      perror(job_output->spill_path);
+    }
+  }
+  if (job_output->spill_fd != -1) {
+    write_all(job_output->spill_fd, data, length);
   }
 }
 
-void set_output_redirect_fg(char* file_name_ptr) {
-  int output_fd = open(file_name_ptr, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-  if (output_fd == -1) {
-    perror("output_fd_fg open()");
-    exit(2);
+struct JobOutput* find_job_output(char* job_ptr) {
+  // '%n' is a job number, anything else a pid
+  int capacity = sizeof(job_outputs.jobs) / sizeof(job_outputs.jobs[0]);
+  bool by_job_number = (job_ptr[0] == '%');
+  int wanted = atoi(by_job_number ? job_ptr + 1 : job_ptr);
+  struct JobOutput *found = NULL;
+  for (int i = 0; i < capacity; i++) {
+    struct JobOutput *job_output = &job_outputs.jobs[i];
+    if (!job_output->in_use) {
+      continue;
+    }
+    if ((by_job_number && job_output->job_number == wanted) || (!by_job_number && job_output->pid == wanted)) {
+      // job numbers get reused, the latest one wins
+      if (!found || job_output->sequence > found->sequence) {
+        found = job_output;
+      }
+    }
   }
-  int result = dup2(output_fd, STDOUT_FILENO);
-  if (result == -1) {
-    perror("output_fd_fg dup2()");
-    exit(3);
+  return found;
+}
+
+void joblog_builtin(char arguments[]) {
+  // 'joblog' lists captured jobs, 'joblog %n' (or a pid) shows one,
+  // 'joblog -c SIZE' sets the capture size for new jobs and
+  // 'joblog -s DIR' / 'joblog -s off' turns spilling to files on and off
+  int capacity = sizeof(job_outputs.jobs) / sizeof(job_outputs.jobs[0]);
+  char* option_ptr = strtok(arguments, " ");
+  if (!option_ptr) {
+    for (int i = 0; i < capacity; i++) {
+      struct JobOutput *job_output = &job_outputs.jobs[i];
+      if (job_output->in_use) {
+        drain_job_output(job_output);
+        printf(
+          "[%d] %d %s %llu bytes captured\n",
+          job_output->job_number,
+          job_output->pid,
+          (job_output->pipe_fd != -1) ? "running" : "done",
+          job_output->total_bytes
+        );
+      }
+    }
+    printf("capture size %zu bytes, spill %s\n", job_outputs.capacity_setting, job_outputs.spill_dir[0] ? job_outputs.spill_dir : "off");
+    fflush(stdout);
+  } else if (strcmp(option_ptr, "-c") == 0) {
+    char* size_ptr = strtok(NULL, " ");
+    char* suffix_ptr = NULL;
+    long long size = size_ptr ? strtoll(size_ptr, &suffix_ptr, 10) : 0;
+    if (suffix_ptr && (*suffix_ptr == 'k' || *suffix_ptr == 'K')) {
+      size *= 1024;
+    } else if (suffix_ptr && (*suffix_ptr == 'm' || *suffix_ptr == 'M')) {
+      size *= 1024 * 1024;
+    }
+    if (size <= 0) {
+      fprintf(stderr, "joblog: invalid capture size '%s'\n", size_ptr ? size_ptr : "");
+      fflush(stderr);
+      return;
+    }
+    job_outputs.capacity_setting = size;
+  } else if (strcmp(option_ptr, "-s") == 0) {
+    char* dir_ptr = strtok(NULL, " ");
+    if (!dir_ptr || strcmp(dir_ptr, "off") == 0) {
+      job_outputs.spill_dir[0] = '\0';
+    } else if (strlen(dir_ptr) >= sizeof(job_outputs.spill_dir)) {
+      fprintf(stderr, "joblog: spill directory path too long\n");
+      fflush(stderr);
+    } else {
+      strcpy(job_outputs.spill_dir, dir_ptr);
+    }
+  } else {
+    struct JobOutput *job_output = find_job_output(option_ptr);
+    if (!job_output) {
+      fprintf(stderr, "joblog: %s: no captured output for that job\n", option_ptr);
+      fflush(stderr);
+      return;
+    }
+    drain_job_output(job_output);
+    if (job_output->overflow_bytes && job_output->spill_path[0]) {
+      printf("[joblog: first %llu bytes are in %s]\n", job_output->overflow_bytes, job_output->spill_path);
+    } else if (job_output->overflow_bytes) {
+      printf("[joblog: first %llu bytes were dropped]\n", job_output->overflow_bytes);
+    }
+    fflush(stdout);
+    size_t first_part = job_output->capacity - job_output->start;
+    if (first_part > job_output->length) {
+      first_part = job_output->length;
+    }
+    write_all(STDOUT_FILENO, job_output->ring + job_output->start, first_part);
+    write_all(STDOUT_FILENO, job_output->ring, job_output->length - first_part);
   }
 }
 
-void set_input_redirect_fg(char* file_name_ptr) {
-  int input_fd = open(file_name_ptr, O_RDONLY);
-  if (input_fd == -1) {
-    perror("input_fd open()");
-    exit(4);
+int add_event_poll_fds(struct pollfd poll_fds[], int poll_fd_count) {
+  // everything the shell keeps an eye on while it waits for something
+  // else: the deadline timer and the output pipes of background jobs
+  if (deadline_heap.size) {
+    poll_fds[poll_fd_count].fd = deadline_heap.timer_fd;
+    poll_fds[poll_fd_count].events = POLLIN;
+    poll_fd_count += 1;
+  }
+  int capacity = sizeof(job_outputs.jobs) / sizeof(job_outputs.jobs[0]);
+  for (int i = 0; i < capacity; i++) {
+    if (job_outputs.jobs[i].in_use && job_outputs.jobs[i].pipe_fd != -1) {
+      poll_fds[poll_fd_count].fd = job_outputs.jobs[i].pipe_fd;
+      poll_fds[poll_fd_count].events = POLLIN;
+      poll_fd_count += 1;
+    }
   }
-  int result = dup2(input_fd, STDIN_FILENO);
-  if (result == -1) {
-    perror("input_fd dup2()");
-    exit(5);
+  return poll_fd_count;
+}
+
+void handle_event_poll_fds(struct pollfd poll_fds[], int first, int poll_fd_count) {
+  int capacity = sizeof(job_outputs.jobs) / sizeof(job_outputs.jobs[0]);
+  for (int i = first; i < poll_fd_count; i++) {
+    if (!poll_fds[i].revents) {
+      continue;
+    }
+    if (poll_fds[i].fd == deadline_heap.timer_fd) {
+      service_expired_deadlines();
+      continue;
+    }
+    for (int j = 0; j < capacity; j++) {
+      if (job_outputs.jobs[j].in_use && job_outputs.jobs[j].pipe_fd == poll_fds[i].fd) {
+        drain_job_output(&job_outputs.jobs[j]);
+        break;
+      }
+    }
   }
 }
 
-void create_arguments_array(char arguments[2048], char* arg_array[512]) {
+char** create_arguments_array(char arguments[]) {
+  // arguments are space separated, so one slot per space (plus the
+  // first argument and the NULL terminator) is always enough
+  size_t slot_count = 2;
+  for (char* c = arguments; *c; c++) {
+    if (*c == ' ') {
+      slot_count += 1;
+    }
+  }
+  char** arg_array = malloc(slot_count * sizeof(char*));
   char* token_ptr = strtok(arguments, " ");
   int index = 0;
   while (token_ptr != NULL) {
@@ -475,11 +2854,11 @@ void create_arguments_array(char arguments[2048], char* arg_array[512]) {
     token_ptr = strtok(NULL, " ");
   }
   arg_array[index] = NULL;
+  return arg_array;
 }
 
 void change_directory(struct Command *command_ptr) {
-  char pathname[2048];
-  strcpy(pathname, command_ptr->arguments);
+  char* pathname = command_ptr->arguments;
   if (strlen(pathname) > 0) {
     chdir(pathname);
   } else {
@@ -495,16 +2874,17 @@ void change_directory(struct Command *command_ptr) {
   */
 }
 
-void initialize_command_struct(struct Command *command_ptr) {
+void initialize_command_struct(struct Command *command_ptr, size_t line_length) {
+  // arguments never hold more than the line itself (plus a trailing space)
+  // until '$$' expansion, which turns 2 characters into at most 10 digits
+  command_ptr->arguments_size = line_length * 5 + 2;
+  command_ptr->arguments = malloc(command_ptr->arguments_size);
   command_ptr->exit = false;
   command_ptr->change_directory = false;
   command_ptr->status = false;
   command_ptr->other_command = false;
-  command_ptr->input_redirect = false;
-  command_ptr->output_redirect = false;
-  memset(command_ptr->arguments, '\0', sizeof(command_ptr->arguments));
-  memset(command_ptr->input_file, '\0', sizeof(command_ptr->input_file));
-  memset(command_ptr->output_file, '\0', sizeof(command_ptr->output_file));
+  memset(command_ptr->arguments, '\0', command_ptr->arguments_size);
+  command_ptr->redirect_count = 0;
   command_ptr->background = false;
   command_ptr->process_id_called = false;
   if (turn_off_background) {
@@ -513,6 +2893,148 @@ void initialize_command_struct(struct Command *command_ptr) {
     command_ptr->background_processes_allowed = true;
   }
   command_ptr->echo_command = false;
+  command_ptr->timeout_ms = 0;
+  command_ptr->timeout_grace_ms = 0;
+  command_ptr->syntax_error = false;
+  command_ptr->trace_command = false;
+  command_ptr->stats_command = false;
+  command_ptr->memo = false;
+  command_ptr->coproc_command = false;
+  memset(command_ptr->coproc_name, '\0', sizeof(command_ptr->coproc_name));
+  command_ptr->enable_command = false;
+  command_ptr->joblog_command = false;
+  command_ptr->loaded_builtin = -1;
+}
+
+void free_command_struct(struct Command *command_ptr) {
+  free(command_ptr->arguments);
+  free(command_ptr);
+}
+
+void terminate_background_processes(struct BackgroundPIDs *background_pids) {
+  // every job gets SIGTERM at once and they're all waited for together,
+  // so this takes at most the grace period however many jobs there are.
+  // whatever is still running after it gets SIGKILL.
+  // SMALLSH_EXIT_GRACE sets the grace period, 5s by default
+  int job_count = background_pids->size;
+  if (!job_count) {
+    return;
+  }
+  long long grace_ms = 5000;
+  char* grace_ptr = getenv("SMALLSH_EXIT_GRACE");
+  if (grace_ptr && !parse_duration_ms(grace_ptr, &grace_ms)) {
+    fprintf(stderr, "exit: invalid SMALLSH_EXIT_GRACE '%s', using 5s\n", grace_ptr);
+    fflush(stderr);
+    grace_ms = 5000;
+  }
+
+  int pid_fds[job_count];
+  bool reaped[job_count];
+  int child_statuses[job_count];
+  for (int i = 0; i < job_count; i++) {
+    pid_fds[i] = -1;
+#ifdef SYS_pidfd_open
+    // opened before the signal so the pid can't be reused in between
+    pid_fds[i] = syscall(SYS_pidfd_open, background_pids->pids[i], 0);
+#endif
+    reaped[i] = false;
+    signal_background_job(background_pids, i, SIGTERM, "exit");
+    // a stopped job has to run to act on the SIGTERM
+    signal_background_job(background_pids, i, SIGCONT, "exit");
+  }
+
+  long long give_up_at_ns = monotonic_time_ns() + grace_ms * 1000000LL;
+  int remaining = job_count;
+  while (remaining) {
+    struct pollfd poll_fds[job_count];
+    int poll_fd_count = 0;
+    bool all_have_pid_fds = true;
+    for (int i = 0; i < job_count; i++) {
+      if (reaped[i]) {
+        continue;
+      }
+      if (waitpid(background_pids->pids[i], &child_statuses[i], WNOHANG) != 0) {
+        reaped[i] = true;
+        remaining -= 1;
+        continue;
+      }
+      if (pid_fds[i] >= 0) {
+        poll_fds[poll_fd_count].fd = pid_fds[i];
+        poll_fds[poll_fd_count].events = POLLIN;
+        poll_fd_count += 1;
+      } else {
+        all_have_pid_fds = false;
+      }
+    }
+    long long now_ns = monotonic_time_ns();
+    if (!remaining || now_ns >= give_up_at_ns) {
+      break;
+    }
+    // without pidfds there's nothing to wake us up, so check back every 50ms
+    long long wait_ms = (give_up_at_ns - now_ns + 999999LL) / 1000000LL;
+    if (!all_have_pid_fds && wait_ms > 50) {
+      wait_ms = 50;
+    }
+    if (poll(poll_fds, poll_fd_count, wait_ms) == -1 && errno != EINTR) {
+      perror("exit poll()");
+      break;
+    }
+  }
+
+  int exited = 0;
+  int terminated = 0;
+  int killed = 0;
+  for (int i = 0; i < job_count; i++) {
+    if (!reaped[i]) {
+      signal_background_job(background_pids, i, SIGKILL, "exit grace period");
+      waitpid(background_pids->pids[i], &child_statuses[i], 0);
+      killed += 1;
+    } else if (WIFEXITED(child_statuses[i])) {
+      exited += 1;
+    } else {
+      terminated += 1;
+    }
+    if (pid_fds[i] >= 0) {
+      close(pid_fds[i]);
+    }
+    if (!WIFEXITED(child_statuses[i])) {
+      atomic_fetch_add_explicit(&shell_metrics.jobs_killed_by_signal, 1, memory_order_relaxed);
+    }
+    if (spawn_trace.enabled) {
+      trace_exit(
+        background_pids->pids[i],
+        background_pids->pgids[i],
+        child_statuses[i],
+        monotonic_time_ns() - background_pids->started_at_ns[i]
+      );
+    }
+    forget_coprocess(background_pids->pids[i]);
+    collect_exec_status(background_pids->exec_status_fds[i]);
+  }
+  background_pids->size = 0;
+  atomic_store(&shell_metrics.background_jobs, 0);
+  printf(
+    "Stopped %d background job%s: %d exited, %d terminated, %d killed after grace period\n",
+    job_count, (job_count == 1) ? "" : "s", exited, terminated, killed
+  );
+  fflush(stdout);
+}
+
+void signal_background_job(struct BackgroundPIDs *background_pids, int index, int signo, char* reason) {
+  // the whole process group when the job has one of its own, otherwise
+  // (it's in the shell's group) just the job itself
+  pid_t target = background_pids->pids[index];
+  if (background_pids->pgids[index] != getpgrp()) {
+    target = -background_pids->pgids[index];
+  }
+  if (kill(target, signo) == -1 && target < 0) {
+    // the group may already be gone while the leader is still unreaped
+    target = background_pids->pids[index];
+    kill(target, signo);
+  }
+  if (spawn_trace.enabled) {
+    trace_signal(target, signo, reason);
+  }
 }
 
 void print_to_console(char string_text[]) {
@@ -520,20 +3042,112 @@ void print_to_console(char string_text[]) {
   fflush(stdout);
 }
 
-char* get_input_from_user() {
-  // as per the requirements, set to capture 2048 characters
-  int BUFFER_SIZE = 2048;
-  char* input_buffer = malloc(sizeof(char) * BUFFER_SIZE);
-  
-  fgets(input_buffer, BUFFER_SIZE, stdin);
+void initialize_line_reader(struct LineReader *reader, int fd) {
+  reader->fd = fd;
+  reader->capacity = 4096;
+  reader->buffer = malloc(reader->capacity);
+  reader->start = 0;
+  reader->scanned = 0;
+  reader->end = 0;
+  reader->eof = false;
+}
+
+char* read_line(struct LineReader *reader, size_t *line_length) {
+  // returns the next line without its newline, NUL terminated in place.
+  // the line lives in the reader's buffer and is only good until the
+  // next call. NULL means end of input
+  while (true) {
+    // memchr is vectorized in glibc, and each byte is only scanned once
+    char* newline_ptr = memchr(reader->buffer + reader->scanned, '\n', reader->end - reader->scanned);
+    if (newline_ptr) {
+      char* line_ptr = reader->buffer + reader->start;
+      *newline_ptr = '\0';
+      *line_length = newline_ptr - line_ptr;
+      reader->start = newline_ptr - reader->buffer + 1;
+      reader->scanned = reader->start;
+      return line_ptr;
+    }
+    reader->scanned = reader->end;
+
+    if (reader->eof) {
+      // a last line without a newline still counts
+      if (reader->start == reader->end) {
+        return NULL;
+      }
+      char* line_ptr = reader->buffer + reader->start;
+      reader->buffer[reader->end] = '\0';
+      *line_length = reader->end - reader->start;
+      reader->start = reader->end;
+      reader->scanned = reader->end;
+      return line_ptr;
+    }
+
+    // make room - slide the partial line to the front, then grow
+    // if it still fills the buffer (one byte is kept for the NUL)
+    if (reader->start > 0) {
+      memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+      reader->end -= reader->start;
+      reader->scanned -= reader->start;
+      reader->start = 0;
+    }
+    if (reader->end + 1 >= reader->capacity) {
+      reader->capacity *= 2;
+      reader->buffer = realloc(reader->buffer, reader->capacity);
+    }
+
+    // the shell spends most of its time right here, so keep the job
+    // deadlines ticking and background output flowing while we wait
+    if (deadline_heap.size || job_outputs.open_pipes) {
+      struct pollfd poll_fds[128];
+      poll_fds[0].fd = reader->fd;
+      poll_fds[0].events = POLLIN;
+      int poll_fd_count = add_event_poll_fds(poll_fds, 1);
+      int ready = poll(poll_fds, poll_fd_count, -1);
+      if (ready == -1 && errno == EINTR) {
+        announce_foreground_only_mode(true);
+        continue;
+      }
+      if (ready > 0) {
+        handle_event_poll_fds(poll_fds, 1, poll_fd_count);
+      }
+      if (ready > 0 && !poll_fds[0].revents) {
+        continue;
+      }
+    }
 
-  return input_buffer;
+    ssize_t bytes_read = read(reader->fd, reader->buffer + reader->end, reader->capacity - reader->end - 1);
+    if (bytes_read == -1) {
+      // SIGTSTP interrupts the read, say what happened and carry on
+      if (errno == EINTR) {
+        announce_foreground_only_mode(true);
+        continue;
+      }
+      perror("read()");
+      reader->eof = true;
+    } else if (bytes_read == 0) {
+      reader->eof = true;
+    } else {
+      reader->end += bytes_read;
+    }
+  }
 }
 
-void remove_newline_from_string(char string_text[]) {
-  int result = strlen(string_text);
-  string_text[result - 1] = '\0';
-  return;
+void announce_foreground_only_mode(bool reprompt) {
+  // for SIGTSTP signals
+  if (!SIGTSTP_called) {
+    return;
+  }
+  if (turn_off_background) {
+    printf("\nEntering foreground-only mode (& is now ignored)\n");
+    fflush(stdout);
+  } else if (!turn_off_background) {
+    printf("\nExiting foreground-only mode\n");
+    fflush(stdout);
+  }
+  SIGTSTP_called = false;
+  if (reprompt) {
+    print_to_console(": ");
+  }
 }
 
 void assign_user_values_to_command_struct(char text_string[], struct Command *command_ptr) {
@@ -543,46 +3157,118 @@ void assign_user_values_to_command_struct(char text_string[], struct Command *co
   // to other pieces of code
   char* token_ptr = strtok(text_string, " ");
   for (; token_ptr != NULL;) {
-    // return from these immediately because they're fairly
-    // self contained
-    if (set_echo_command(token_ptr, command_ptr)) {
-      while (token_ptr != NULL) {
+    // redirects can go anywhere on the line
+    if (could_be_redirect(token_ptr) && parse_redirect(token_ptr, command_ptr)) {
+      if (command_ptr->syntax_error)
+        return;
+      token_ptr = strtok(NULL, " ");
+      continue;
+    }
+
+    // a single probe of the builtin table sorts builtins (and the
+    // background operator) from everything else
+    switch (find_core_builtin(token_ptr)) {
+      // return from these immediately because they're fairly
+      // self contained
+      case BUILTIN_ECHO: {
+        set_echo_command(command_ptr);
         set_other_command_and_arguments(token_ptr, command_ptr);
+        set_remaining_arguments(command_ptr);
+        return;
+      }
+      case BUILTIN_EXIT: {
+        set_exit_flag(command_ptr);
+        return;
+      }
+      // timeout is a prefix, the command it guards follows it
+      case BUILTIN_TIMEOUT: {
+        if (!set_timeout_flag(command_ptr))
+          break;
+        if (command_ptr->syntax_error)
+          return;
         token_ptr = strtok(NULL, " ");
+        continue;
       }
-      return;
-    }
-    if (set_exit_flag(token_ptr, command_ptr))
-      return;
-    if (set_change_directory_flag(token_ptr, command_ptr)) {
-      token_ptr = strtok(NULL, " ");
-      if (token_ptr) {
-        set_process_id_called_flag(token_ptr, command_ptr);
-        strcpy(command_ptr->arguments, token_ptr);
+      // and coproc, with its name in between
+      case BUILTIN_COPROC: {
+        if (!set_coproc_flag(command_ptr))
+          break;
+        if (command_ptr->syntax_error)
+          return;
+        token_ptr = strtok(NULL, " ");
+        continue;
+      }
+      // so is memo
+      case BUILTIN_MEMO: {
+        if (!set_memo_flag(command_ptr))
+          break;
+        token_ptr = strtok(NULL, " ");
+        continue;
+      }
+      case BUILTIN_CD: {
+        set_change_directory_flag(command_ptr);
+        token_ptr = strtok(NULL, " ");
+        if (token_ptr && !(could_be_redirect(token_ptr) && parse_redirect(token_ptr, command_ptr))) {
+          set_process_id_called_flag(token_ptr, command_ptr);
+          strcpy(command_ptr->arguments, token_ptr);
+        }
+        set_trailing_redirects(command_ptr);
+        return;
+      }
+      case BUILTIN_STATUS: {
+        set_status_flag(command_ptr);
+        set_trailing_redirects(command_ptr);
+        return;
+      }
+      case BUILTIN_STATS: {
+        if (!set_stats_flag(command_ptr))
+          break;
+        set_remaining_arguments(command_ptr);
+        return;
+      }
+      case BUILTIN_TRACE: {
+        if (!set_trace_flag(command_ptr))
+          break;
+        token_ptr = strtok(NULL, " ");
+        if (token_ptr && !(could_be_redirect(token_ptr) && parse_redirect(token_ptr, command_ptr))) {
+          strcpy(command_ptr->arguments, token_ptr);
+        }
+        set_trailing_redirects(command_ptr);
+        return;
+      }
+      case BUILTIN_JOBLOG: {
+        if (!set_joblog_flag(command_ptr))
+          break;
+        set_remaining_arguments(command_ptr);
+        return;
+      }
+      case BUILTIN_ENABLE: {
+        if (!set_enable_flag(command_ptr))
+          break;
+        set_remaining_arguments(command_ptr);
+        return;
+      }
+
+      // We dont want to immediately return from this,
+      // because it's used in combination with other arguments
+      case BUILTIN_BACKGROUND: {
+        set_background_flag(command_ptr);
+        token_ptr = strtok(NULL, " ");
+        continue;
+      }
+      case NOT_A_BUILTIN: {
+        // builtins loaded with 'enable -f' only count as the command itself
+        if (loaded_builtins.size && !command_ptr->other_command) {
+          command_ptr->loaded_builtin = find_loaded_builtin(token_ptr);
+        }
+        break;
       }
-      return;
     }
-    if (set_status_flag(token_ptr, command_ptr))
-      return;
+
     // for the p3testscript file
     if (check_if_token_is_actually_a_test_comment(token_ptr, command_ptr))
       return;
 
-    // We dont want to immediately return from these,
-    // because they're used in combination with other arguments
-    if (set_output_file(token_ptr, command_ptr)) {
-      token_ptr = strtok(NULL, " ");
-      continue;
-    }
-    if (set_input_file(token_ptr, command_ptr)) {
-      token_ptr = strtok(NULL, " ");
-      continue;
-    }
-    if (set_background_flag(token_ptr, command_ptr)) {
-      token_ptr = strtok(NULL, " ");
-      continue;
-    }
-
     // if token doesnt match any of the qualifiers above, 
     // its probably a regular ol' command!
     set_other_command_and_arguments(token_ptr, command_ptr);
@@ -594,15 +3280,90 @@ void assign_user_values_to_command_struct(char text_string[], struct Command *co
   }
 }
 
-bool set_echo_command(char* token_ptr, struct Command *command_ptr) {
-  if (strcmp(token_ptr, "echo") == 0) {
-    command_ptr->echo_command = true;
+enum BuiltinId find_core_builtin(char* token_ptr) {
+  // perfect hash: each name in core_builtins has a slot of its own
+  size_t length = strlen(token_ptr);
+  unsigned int slot = CORE_SLOT(
+    (unsigned char)token_ptr[0],
+    (unsigned char)token_ptr[length - 1],
+    length
+  );
+  if (core_builtins[slot].name && strcmp(core_builtins[slot].name, token_ptr) == 0) {
+    return core_builtins[slot].id;
+  }
+  return NOT_A_BUILTIN;
+}
+
+void set_echo_command(struct Command *command_ptr) {
+  command_ptr->echo_command = true;
+}
+
+bool set_timeout_flag(struct Command *command_ptr) {
+  // only a prefix to the command, 'sleep timeout' is just an argument
+  if (command_ptr->other_command || command_ptr->timeout_ms > 0) {
+    return false;
+  }
+  // SIGKILL follows SIGTERM after 5 seconds unless -k says otherwise
+  command_ptr->timeout_grace_ms = 5000;
+  char* duration_ptr = strtok(NULL, " ");
+  if (duration_ptr && strcmp(duration_ptr, "-k") == 0) {
+    char* grace_ptr = strtok(NULL, " ");
+    if (!grace_ptr || !parse_duration_ms(grace_ptr, &command_ptr->timeout_grace_ms)) {
+      fprintf(stderr, "timeout: invalid grace period '%s'\n", grace_ptr ? grace_ptr : "");
+      fflush(stderr);
+      command_ptr->syntax_error = true;
+      return true;
+    }
+    duration_ptr = strtok(NULL, " ");
+  }
+  if (!duration_ptr || !parse_duration_ms(duration_ptr, &command_ptr->timeout_ms) || command_ptr->timeout_ms == 0) {
+    fprintf(stderr, "timeout: invalid duration '%s'\n", duration_ptr ? duration_ptr : "");
+    fflush(stderr);
+    command_ptr->syntax_error = true;
+  }
+  return true;
+}
+
+bool set_memo_flag(struct Command *command_ptr) {
+  if (!command_ptr->other_command && !command_ptr->memo) {
+    command_ptr->memo = true;
     return true;
   } else {
     return false;
   }
 }
 
+bool parse_duration_ms(char* duration_str, long long *duration_ms) {
+  // accepts things like 10, 2.5s, 500ms, 3m, 1h - plain numbers are seconds
+  char* suffix_ptr;
+  errno = 0;
+  double value = strtod(duration_str, &suffix_ptr);
+  if (errno || suffix_ptr == duration_str || value < 0) {
+    return false;
+  }
+  double multiplier;
+  if (strcmp(suffix_ptr, "") == 0 || strcmp(suffix_ptr, "s") == 0) {
+    multiplier = 1000;
+  } else if (strcmp(suffix_ptr, "ms") == 0) {
+    multiplier = 1;
+  } else if (strcmp(suffix_ptr, "m") == 0) {
+    multiplier = 60 * 1000;
+  } else if (strcmp(suffix_ptr, "h") == 0) {
+    multiplier = 60 * 60 * 1000;
+  } else {
+    return false;
+  }
+  // deadlines are kept in nanoseconds on the monotonic clock, so the
+  // duration has to fit there with room to add it to the current time
+  // (about 146 years). the negated test also turns away nan and inf
+  double milliseconds = value * multiplier;
+  if (!(milliseconds <= (double)(LLONG_MAX / 2000000LL))) {
+    return false;
+  }
+  *duration_ms = (long long)milliseconds;
+  return true;
+}
+
 bool check_if_token_is_actually_a_test_comment(char* token_ptr, struct Command *command_ptr) {
   if (token_ptr[0] == '(') {
     return true;
@@ -627,72 +3388,212 @@ bool set_process_id_called_flag(char* token_ptr, struct Command *command_ptr) {
   }
 }
 
-bool set_exit_flag(char* token_ptr, struct Command *command_ptr) {
-  if (strcmp(token_ptr, "exit") == 0) {
-    command_ptr->exit = true;
+void set_exit_flag(struct Command *command_ptr) {
+  command_ptr->exit = true;
+}
+
+void set_change_directory_flag(struct Command *command_ptr) {
+  command_ptr->change_directory = true;
+}
+
+void set_status_flag(struct Command *command_ptr) {
+  command_ptr->status = true;
+}
+
+bool set_trace_flag(struct Command *command_ptr) {
+  // only as the command itself, 'grep trace' shouldn't toggle tracing
+  if (!command_ptr->other_command) {
+    command_ptr->trace_command = true;
     return true;
   } else {
     return false;
   }
 }
 
-bool set_change_directory_flag(char* token_ptr, struct Command *command_ptr) {
-  if (strcmp(token_ptr, "cd") == 0) {
-    command_ptr->change_directory = true;
-    /*
-    token_ptr = strtok(NULL, " ");
-    if (token_ptr) {
-      strcpy(command_ptr->arguments, token_ptr);
-    }
-    */
+bool set_stats_flag(struct Command *command_ptr) {
+  if (!command_ptr->other_command) {
+    command_ptr->stats_command = true;
     return true;
   } else {
     return false;
   }
 }
 
-bool set_status_flag(char* token_ptr, struct Command *command_ptr) {
-  if (strcmp(token_ptr, "status") == 0) {
-    command_ptr->status = true;
+bool set_enable_flag(struct Command *command_ptr) {
+  if (!command_ptr->other_command) {
+    command_ptr->enable_command = true;
     return true;
   } else {
     return false;
   }
 }
 
-bool set_output_file(char* token_ptr, struct Command *command_ptr) {
-  if (strcmp(token_ptr, ">") == 0) {
-    token_ptr = strtok(NULL, " ");
-    strcpy(command_ptr->output_file, token_ptr);
-    command_ptr->output_redirect = true;
-    return true;
-  } else {
+bool set_coproc_flag(struct Command *command_ptr) {
+  if (command_ptr->other_command || command_ptr->coproc_command) {
     return false;
   }
+  command_ptr->coproc_command = true;
+  // a coprocess always runs alongside the shell, foreground-only mode or not
+  command_ptr->background = true;
+  command_ptr->background_processes_allowed = true;
+  char* name_ptr = strtok(NULL, " ");
+  if (!name_ptr) {
+    return true;
+  }
+  bool valid_name = strlen(name_ptr) < sizeof(command_ptr->coproc_name) &&
+    (isalpha((unsigned char)name_ptr[0]) || name_ptr[0] == '_');
+  for (char* char_ptr = name_ptr; *char_ptr && valid_name; char_ptr++) {
+    valid_name = isalnum((unsigned char)*char_ptr) || *char_ptr == '_';
+  }
+  if (!valid_name) {
+    fprintf(stderr, "coproc: invalid name '%s'\n", name_ptr);
+    fflush(stderr);
+    command_ptr->syntax_error = true;
+    return true;
+  }
+  strcpy(command_ptr->coproc_name, name_ptr);
+  return true;
 }
 
-bool set_input_file(char* token_ptr, struct Command *command_ptr) {
-  if (strcmp(token_ptr, "<") == 0) {
-    token_ptr = strtok(NULL, " ");
-    strcpy(command_ptr->input_file, token_ptr);
-    command_ptr->input_redirect = true;
+bool set_joblog_flag(struct Command *command_ptr) {
+  if (!command_ptr->other_command) {
+    command_ptr->joblog_command = true;
     return true;
   } else {
     return false;
   }
 }
 
-bool set_background_flag(char* token_ptr, struct Command *command_ptr) {
-  if (strcmp(token_ptr, "&") == 0) {
-    if (command_ptr->background_processes_allowed) {
-      command_ptr->background = true;
-    } else {
-      command_ptr->background = false;
+bool could_be_redirect(char* token_ptr) {
+  // every redirect starts with <, >, & or an fd number. checking that
+  // first keeps ordinary words away from parse_redirect's compares
+  char first = token_ptr[0];
+  return first == '<' || first == '>' || first == '&' || isdigit((unsigned char)first);
+}
+
+bool parse_redirect(char* token_ptr, struct Command *command_ptr) {
+  // [n]< [n]> [n]>> [n]<> take the next token as a file, so do &> and
+  // &>> which send stdout and stderr there together. [n]>&m and [n]<&m
+  // make fd n a copy of fd m, m can also be a coprocess's ${NAME[0]} or
+  // ${NAME[1]}. returns false for anything else
+  char* operator_ptr = token_ptr;
+  long fd = -1;
+  bool both_outputs = false;
+  bool coprocess_reference = false;
+  if (strncmp(operator_ptr, "&>", 2) == 0) {
+    both_outputs = true;
+    operator_ptr += 1;
+  } else if (isdigit((unsigned char)operator_ptr[0])) {
+    fd = strtol(operator_ptr, &operator_ptr, 10);
+  }
+
+  int flags = 0;
+  int default_fd;
+  long from_fd = -1;
+  if (strcmp(operator_ptr, "<") == 0) {
+    flags = O_RDONLY;
+    default_fd = STDIN_FILENO;
+  } else if (strcmp(operator_ptr, ">") == 0) {
+    flags = O_WRONLY | O_CREAT | O_TRUNC;
+    default_fd = STDOUT_FILENO;
+  } else if (strcmp(operator_ptr, ">>") == 0) {
+    flags = O_WRONLY | O_CREAT | O_APPEND;
+    default_fd = STDOUT_FILENO;
+  } else if (strcmp(operator_ptr, "<>") == 0 && !both_outputs) {
+    flags = O_RDWR | O_CREAT;
+    default_fd = STDIN_FILENO;
+  } else if ((operator_ptr[0] == '<' || operator_ptr[0] == '>') && operator_ptr[1] == '&' &&
+             operator_ptr[2] == '$' && !both_outputs) {
+    // >&${NAME[1]} and <&${NAME[0]} for coprocesses
+    if (!parse_coprocess_fd(operator_ptr + 2, &from_fd)) {
+      command_ptr->syntax_error = true;
+      return true;
     }
-    return true;
+    coprocess_reference = true;
+    default_fd = (operator_ptr[0] == '<') ? STDIN_FILENO : STDOUT_FILENO;
+  } else if ((operator_ptr[0] == '<' || operator_ptr[0] == '>') && operator_ptr[1] == '&' &&
+             isdigit((unsigned char)operator_ptr[2]) && !both_outputs) {
+    char* end_ptr;
+    from_fd = strtol(operator_ptr + 2, &end_ptr, 10);
+    if (*end_ptr != '\0') {
+      return false;
+    }
+    default_fd = (operator_ptr[0] == '<') ? STDIN_FILENO : STDOUT_FILENO;
   } else {
     return false;
   }
+  if (fd == -1) {
+    fd = default_fd;
+  }
+  // 0-9 like sh. the shell keeps its own fds at 10 and up (see
+  // move_fd_high), a redirect can't name one except through ${NAME[n]}
+  if (fd > 9 || (from_fd > 9 && !coprocess_reference)) {
+    fprintf(stderr, "%s: file descriptor out of range\n", token_ptr);
+    fflush(stderr);
+    command_ptr->syntax_error = true;
+    return true;
+  }
+
+  char* file_name_ptr = "";
+  if (from_fd == -1) {
+    file_name_ptr = strtok(NULL, " ");
+    if (!file_name_ptr || strlen(file_name_ptr) >= sizeof(command_ptr->redirects[0].file)) {
+      fprintf(stderr, "missing or too long file name after '%s'\n", token_ptr);
+      fflush(stderr);
+      command_ptr->syntax_error = true;
+      return true;
+    }
+  }
+  add_redirect(command_ptr, fd, flags, from_fd, file_name_ptr);
+  if (both_outputs) {
+    add_redirect(command_ptr, STDERR_FILENO, 0, STDOUT_FILENO, "");
+  }
+  return true;
+}
+
+void add_redirect(struct Command *command_ptr, int fd, int flags, int from_fd, char* file_name_ptr) {
+  if (command_ptr->redirect_count == sizeof(command_ptr->redirects) / sizeof(command_ptr->redirects[0])) {
+    fprintf(stderr, "too many redirects\n");
+    fflush(stderr);
+    command_ptr->syntax_error = true;
+    return;
+  }
+  struct Redirect *redirect = &command_ptr->redirects[command_ptr->redirect_count];
+  redirect->fd = fd;
+  redirect->flags = flags;
+  redirect->from_fd = from_fd;
+  strcpy(redirect->file, file_name_ptr);
+  command_ptr->redirect_count += 1;
+}
+
+void set_remaining_arguments(struct Command *command_ptr) {
+  // the rest of the line is arguments, apart from any redirects
+  char* token_ptr = strtok(NULL, " ");
+  while (token_ptr != NULL && !command_ptr->syntax_error) {
+    if (!(could_be_redirect(token_ptr) && parse_redirect(token_ptr, command_ptr))) {
+      set_other_command_and_arguments(token_ptr, command_ptr);
+    }
+    token_ptr = strtok(NULL, " ");
+  }
+}
+
+void set_trailing_redirects(struct Command *command_ptr) {
+  // builtins with at most one argument ignore the rest of the line,
+  // redirects excepted
+  char* token_ptr = strtok(NULL, " ");
+  while (token_ptr != NULL && !command_ptr->syntax_error) {
+    if (could_be_redirect(token_ptr))
+      parse_redirect(token_ptr, command_ptr);
+    token_ptr = strtok(NULL, " ");
+  }
+}
+
+void set_background_flag(struct Command *command_ptr) {
+  if (command_ptr->background_processes_allowed) {
+    command_ptr->background = true;
+  } else {
+    command_ptr->background = false;
+  }
 }
 
 bool is_blank(char text_string[]) {
@@ -779,7 +3680,7 @@ int perform_variable_expansion(char argument_str[], char* new_str) {
     }
 
     // create char array to store the value of pid
-    char pid_str[7];
+    char pid_str[16];
     memset(pid_str, '\0', sizeof(pid_str));
     pid_t program_pid = getpid();
     // special way to write the pid_t to char array
@@ -846,24 +3747,16 @@ void log_command_struct(struct Command *command_ptr) {
     printf("command.other_command=%d\n", command_ptr->other_command);
     fflush(stdout);
   }
-  if (command_ptr->input_redirect) {
-    printf("command.input_redirect=%d\n", command_ptr->input_redirect);
-    fflush(stdout);
-  }
-  if (command_ptr->output_redirect) {
-    printf("command.output_redirect=%d\n", command_ptr->output_redirect);
-    fflush(stdout);
-  }
   if (strlen(command_ptr->arguments) > 0) {
     printf("command.arguments=%s\n", command_ptr->arguments);
     fflush(stdout);
   }
-  if (strlen(command_ptr->input_file) > 0) {
-    printf("command.input_file=%s\n", command_ptr->input_file);
-    fflush(stdout);
-  }
-  if (strlen(command_ptr->output_file) > 0) {
-    printf("command.output_file=%s\n", command_ptr->output_file);
+  for (int i = 0; i < command_ptr->redirect_count; i++) {
+    if (command_ptr->redirects[i].from_fd >= 0) {
+      printf("command.redirects[%d]=%d>&%d\n", i, command_ptr->redirects[i].fd, command_ptr->redirects[i].from_fd);
+    } else {
+      printf("command.redirects[%d]=%d %s\n", i, command_ptr->redirects[i].fd, command_ptr->redirects[i].file);
+    }
     fflush(stdout);
   }
   if (command_ptr->background) {
@@ -0,0 +1,39 @@
+// Interface for builtins loaded into smallsh at runtime with
+//   enable -f ./library.so name
+//
+// A library exports one struct smallsh_builtin per builtin, under the
+// symbol smallsh_builtin_<name>:
+//
+//   #include "smallsh_builtin.h"
+//
+//   static int run_hello(int argc, char* argv[]) {
+//     printf("hello %s\n", (argc > 1) ? argv[1] : "world");
+//     return 0;
+//   }
+//
+//   struct smallsh_builtin smallsh_builtin_hello = {
+//     SMALLSH_BUILTIN_ABI_VERSION, "hello", run_hello
+//   };
+//
+// and is built with: gcc -shared -fPIC hello.c -o hello.so
+//
+// run() gets the command's argv (argv[0] is the builtin's name) and its
+// return value becomes the exit status. Foreground calls happen inside
+// the shell process with stdin/stdout already redirected, so run() must
+// not exit(), and must put back anything else it changes (signal
+// handlers, working directory, ...). Background and timeout calls
+// happen in a forked child.
+#ifndef SMALLSH_BUILTIN_H
+#define SMALLSH_BUILTIN_H
+
+// bumped whenever struct smallsh_builtin changes shape,
+// the shell refuses libraries built against another version
+#define SMALLSH_BUILTIN_ABI_VERSION 1
+
+struct smallsh_builtin {
+  unsigned int abi_version;
+  const char* name;
+  int (*run)(int argc, char* argv[]);
+};
+
+#endif